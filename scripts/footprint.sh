@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds the default (debug) and release configurations side by side, and
+# saves a RAM and ROM report for each into footprint/.
+#
+# Usage: scripts/footprint.sh [board]
+set -e
+
+board="${1:-nrf52840dk/nrf52840}"
+out=footprint
+mkdir -p "$out"
+
+build() {
+    name="$1"
+    shift
+    west build -p -b "$board" -d "build-$name" "$@"
+    west build -d "build-$name" -t ram_report > "$out/$name-ram.txt"
+    west build -d "build-$name" -t rom_report > "$out/$name-rom.txt"
+}
+
+build debug
+build release -- -DEXTRA_CONF_FILE=release.conf
+
+head -n 3 "$out"/*-ram.txt "$out"/*-rom.txt
@@ -0,0 +1,125 @@
+#include "main.h"
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+
+LOG_MODULE_REGISTER(activity, CONFIG_D2H_ACTIVITY_LOG_LEVEL);
+
+static const char *state_names[ACTIVITY_STATE_COUNT] = {
+    [ACTIVITY_ACTIVE] = "active",
+    [ACTIVITY_IDLE] = "idle",
+    [ACTIVITY_SUSPENDED] = "suspended",
+};
+
+/* owned by the decoder thread */
+static enum activity_state state = ACTIVITY_ACTIVE;
+static int64_t last_activity = 0;
+static int64_t state_since = 0;
+static int64_t state_msec[ACTIVITY_STATE_COUNT] = {};
+
+static atomic_t usb_suspended = ATOMIC_INIT(0);
+static atomic_t reset_pending = ATOMIC_INIT(0);
+
+/* k_uptime_get_32() of the first active packet after idle, 0 once the
+ * first report after it has gone out */
+static atomic_t resume_start = ATOMIC_INIT(0);
+static uint32_t resume_last_msec = 0;
+static uint32_t resume_max_msec = 0;
+
+
+static void transition(enum activity_state next, int64_t now)
+{
+    state_msec[state] += now - state_since;
+    state_since = now;
+
+    LOG_INF("%s -> %s", state_names[state], state_names[next]);
+
+    if (next == ACTIVITY_ACTIVE) {
+        atomic_set(&resume_start, MAX(k_uptime_get_32(), 1));
+        bluetooth_set_conn_preset(CONN_PRESET_ACTIVE);
+    } else if (state == ACTIVITY_ACTIVE) {
+        bluetooth_set_conn_preset(CONN_PRESET_IDLE);
+    }
+
+    state = next;
+}
+
+bool activity_update(bool active)
+{
+    int64_t now = k_uptime_get();
+    enum activity_state next = state;
+
+    if (atomic_clear(&reset_pending)) {
+        last_activity = now;
+        next = ACTIVITY_ACTIVE;
+    }
+
+    if (active) {
+        last_activity = now;
+        next = ACTIVITY_ACTIVE;
+    } else if (now - last_activity >= CONFIG_D2H_IDLE_TIMEOUT_MSEC) {
+        next = ACTIVITY_IDLE;
+    }
+
+    /* a suspended USB host only matters if there's nowhere else to send */
+    if (atomic_get(&usb_suspended) && !transport_select()) {
+        if (active) {
+            usb_rwup_if_suspended();
+        }
+        next = ACTIVITY_SUSPENDED;
+    }
+
+    if (next != state) {
+        transition(next, now);
+    }
+
+    return state == ACTIVITY_ACTIVE;
+}
+
+void activity_usb_suspended(bool suspended)
+{
+    atomic_set(&usb_suspended, suspended);
+}
+
+void activity_reset()
+{
+    atomic_set(&reset_pending, 1);
+}
+
+void activity_report_delivered()
+{
+    uint32_t start = atomic_clear(&resume_start);
+
+    if (!start) {
+        return;
+    }
+
+    resume_last_msec = k_uptime_get_32() - start;
+    resume_max_msec = MAX(resume_max_msec, resume_last_msec);
+    LOG_INF("resumed in %u ms", resume_last_msec);
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static int cmd_power(const struct shell *sh, size_t argc, char **argv)
+{
+    int64_t now = k_uptime_get();
+
+    for (size_t i = 0; i < ACTIVITY_STATE_COUNT; ++i) {
+        int64_t msec = state_msec[i];
+        if (i == state) {
+            msec += now - state_since;
+        }
+        shell_print(sh, "%-10s %lld ms%s", state_names[i], (long long)msec,
+            i == state ? " (current)" : "");
+    }
+
+    shell_print(sh, "resume latency: last %u ms, max %u ms",
+        resume_last_msec, resume_max_msec);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), power, NULL, "Time spent in each activity state",
+    cmd_power, 1, 0);
+#endif
@@ -0,0 +1,78 @@
+#include "main.h"
+#include <stdlib.h>
+
+/*
+ * The arithmetic behind gyro bias estimation, kept apart from the Bluetooth
+ * and settings handling in gyro_bias.c so tests/gyro_bias can run it on
+ * native_sim.
+ *
+ * A window holds running sums and sums of squares of each axis, which costs
+ * the same per sample however long the window is, and is exact in integers.
+ */
+
+/* each still window moves the estimate 1/BIAS_WEIGHT of the way to its mean */
+#define BIAS_WEIGHT 4
+
+
+void bias_window_add(struct bias_window *w,
+    int32_t const sample[BIAS_AXIS_COUNT])
+{
+    w->n += 1;
+    for (size_t i = 0; i < BIAS_AXIS_COUNT; ++i) {
+        w->sum[i] += sample[i];
+        w->sum_sq[i] += (int64_t)sample[i] * sample[i];
+    }
+}
+
+uint32_t bias_window_variance(struct bias_window const *w, enum bias_axis axis)
+{
+    int64_t n = w->n;
+    int64_t sum = w->sum[axis];
+    return (n * w->sum_sq[axis] - sum * sum) / (n * n);
+}
+
+int32_t bias_window_mean_q8(struct bias_window const *w, enum bias_axis axis)
+{
+    return ((int64_t)w->sum[axis] * 256) / (int32_t)w->n;
+}
+
+/* Whether the controller was lying still for the whole window. Fills in each
+ * axis's variance either way, for diagnostics. */
+bool bias_window_is_still(struct bias_window const *w,
+    uint32_t variance[BIAS_AXIS_COUNT])
+{
+    bool still = true;
+
+    for (size_t i = 0; i < BIAS_AXIS_COUNT; ++i) {
+        uint32_t limit = i < BIAS_GYRO_AXIS_COUNT
+            ? CONFIG_D2H_GYRO_BIAS_GYRO_VAR_MAX
+            : CONFIG_D2H_GYRO_BIAS_ACCEL_VAR_MAX;
+        variance[i] = bias_window_variance(w, i);
+        still = still && variance[i] <= limit;
+    }
+
+    /* a slow, steady turn has low variance too */
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        still = still &&
+            abs(bias_window_mean_q8(w, i)) <= CONFIG_D2H_GYRO_BIAS_MAX * 256;
+    }
+
+    return still;
+}
+
+/* Move the estimate towards a still window's mean, or start it there if this
+ * is the first. residual_q8 is what would have been left over after
+ * correcting the window with the estimate as it was. */
+void bias_window_correct(struct bias_window const *w, bool first,
+    int32_t bias_q8[BIAS_GYRO_AXIS_COUNT],
+    int32_t residual_q8[BIAS_GYRO_AXIS_COUNT])
+{
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        int32_t mean_q8 = bias_window_mean_q8(w, i);
+        if (first) {
+            bias_q8[i] = mean_q8;
+        }
+        residual_q8[i] = mean_q8 - bias_q8[i];
+        bias_q8[i] += residual_q8[i] / BIAS_WEIGHT;
+    }
+}
@@ -6,14 +6,29 @@
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/drivers/gpio.h>
+#include <zephyr/settings/settings.h>
 
 
 #define MSEC_TO_ISO(msec_) (msec_)
 
 #define CONN_INTERVAL_MIN_MSEC      15
 #define CONN_INTERVAL_MAX_MSEC      15
+#define CONN_LATENCY                1
 #define CONN_TIMEOUT_MSEC           2000
 
+#define CONN_IDLE_INTERVAL_MIN_MSEC 60
+#define CONN_IDLE_INTERVAL_MAX_MSEC 90
+#define CONN_IDLE_LATENCY           4
+#define CONN_IDLE_TIMEOUT_MSEC      4000
+
+/* for a poor link: the controller listens at every connection event, so a
+ * missed notification is retried sooner, and a fade has to last longer
+ * before the link is given up */
+#define CONN_ROBUST_INTERVAL_MIN_MSEC 15
+#define CONN_ROBUST_INTERVAL_MAX_MSEC 15
+#define CONN_ROBUST_LATENCY         0
+#define CONN_ROBUST_TIMEOUT_MSEC    6000
+
 
 static void start_scan();
 static void on_scan_device_found(
@@ -21,6 +36,12 @@ static void on_scan_device_found(
     struct net_buf_simple *ad);
 static void on_connected(struct bt_conn *conn, uint8_t err);
 static void on_disconnected(struct bt_conn *conn, uint8_t reason);
+static void on_le_param_updated(struct bt_conn *conn, uint16_t interval,
+    uint16_t latency, uint16_t timeout);
+#if defined(CONFIG_D2H_LINK_MONITOR)
+static void on_le_phy_updated(struct bt_conn *conn,
+    struct bt_conn_le_phy_info *param);
+#endif
 static void on_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx);
 static void on_gatt_exchange_mtu(struct bt_conn *conn, uint8_t err,
     struct bt_gatt_exchange_params *params);
@@ -31,6 +52,8 @@ static uint8_t on_notify(struct bt_conn *conn,
 
 
 static struct bt_conn *open_conn = NULL;
+static atomic_t conn_preset = ATOMIC_INIT(CONN_PRESET_ACTIVE);
+static atomic_t link_robust = ATOMIC_INIT(0);
 static struct bt_uuid_128 discover_uuid = {};
 static struct bt_gatt_discover_params discover_params = {};
 static struct bt_gatt_subscribe_params subscribe_params = {};
@@ -44,6 +67,10 @@ static const struct bt_uuid_128 daydream_data_uuid = BT_UUID_INIT_128(
 BT_CONN_CB_DEFINE(conn_cbs) = {
     .connected = on_connected,
     .disconnected = on_disconnected,
+    .le_param_updated = on_le_param_updated,
+#if defined(CONFIG_D2H_LINK_MONITOR)
+    .le_phy_updated = on_le_phy_updated,
+#endif
 };
 
 static struct bt_gatt_cb gatt_callbacks = {
@@ -54,8 +81,18 @@ static struct bt_gatt_exchange_params mtu_exchange_params = {
     .func = on_gatt_exchange_mtu
 };
 
-LOG_MODULE_REGISTER(bluetooth, LOG_LEVEL_INF);
+LOG_MODULE_REGISTER(bluetooth, CONFIG_D2H_BLUETOOTH_LOG_LEVEL);
+
+
+/* The controller link is the one where we're the central; with BLE HID on,
+ * the same callbacks also see the host link */
+static bool is_controller_conn(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
 
+    return !bt_conn_get_info(conn, &info) &&
+        info.role == BT_CONN_ROLE_CENTRAL;
+}
 
 static void start_scan()
 {
@@ -65,7 +102,7 @@ static void start_scan()
         return;
     }
 
-    led_flash(750, 250, LED_BT_STATUS);
+    led_set(LED_BT_STATUS, LED_PATTERN_BLINK_SLOW);
 
     LOG_INF("Starting scan");
 }
@@ -96,7 +133,9 @@ static void on_scan_device_found(
         return;
     }
 
-    LOG_HEXDUMP_DBG(ad->data, ad->len, "ad");
+    if (IS_ENABLED(CONFIG_D2H_LOG_HOT_PATH)) {
+        LOG_HEXDUMP_DBG(ad->data, ad->len, "ad");
+    }
 
     bool is_daydream = false;
     bt_data_parse(ad, is_daydream_controller, &is_daydream);
@@ -104,7 +143,9 @@ static void on_scan_device_found(
     if (is_daydream) {
         char dev[BT_ADDR_LE_STR_LEN];
         bt_addr_le_to_str(addr, dev, sizeof(dev));
-        LOG_INF("Found daydream! %s", dev);
+        LOG_INF("Found daydream! %s rssi %d", dev, rssi);
+        link_scan_rssi(rssi);
+        milestone_reached(MILESTONE_CONTROLLER_FOUND);
     } else {
         return;
     }
@@ -129,13 +170,41 @@ static void on_scan_device_found(
 
 static void set_conn_params(struct k_work *work)
 {
-    static struct bt_le_conn_param params = BT_LE_CONN_PARAM_INIT(
-        BT_GAP_MS_TO_CONN_INTERVAL(CONN_INTERVAL_MIN_MSEC),
-        BT_GAP_MS_TO_CONN_INTERVAL(CONN_INTERVAL_MAX_MSEC),
-        1,
-        BT_GAP_MS_TO_CONN_TIMEOUT(CONN_TIMEOUT_MSEC)
-    );
-    bt_conn_le_param_update(open_conn, &params);
+    static struct bt_le_conn_param presets[CONN_PRESET_COUNT] = {
+        [CONN_PRESET_ACTIVE] = BT_LE_CONN_PARAM_INIT(
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_INTERVAL_MIN_MSEC),
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_INTERVAL_MAX_MSEC),
+            CONN_LATENCY,
+            BT_GAP_MS_TO_CONN_TIMEOUT(CONN_TIMEOUT_MSEC)
+        ),
+        [CONN_PRESET_IDLE] = BT_LE_CONN_PARAM_INIT(
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_IDLE_INTERVAL_MIN_MSEC),
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_IDLE_INTERVAL_MAX_MSEC),
+            CONN_IDLE_LATENCY,
+            BT_GAP_MS_TO_CONN_TIMEOUT(CONN_IDLE_TIMEOUT_MSEC)
+        ),
+        [CONN_PRESET_ROBUST] = BT_LE_CONN_PARAM_INIT(
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_ROBUST_INTERVAL_MIN_MSEC),
+            BT_GAP_MS_TO_CONN_INTERVAL(CONN_ROBUST_INTERVAL_MAX_MSEC),
+            CONN_ROBUST_LATENCY,
+            BT_GAP_MS_TO_CONN_TIMEOUT(CONN_ROBUST_TIMEOUT_MSEC)
+        ),
+    };
+
+    struct bt_conn *conn = open_conn;
+    if (!conn) {
+        return;
+    }
+
+    enum conn_preset preset = atomic_get(&conn_preset);
+    if (preset == CONN_PRESET_ACTIVE && atomic_get(&link_robust)) {
+        preset = CONN_PRESET_ROBUST;
+    }
+    COUNTER_SET(link_preset, preset);
+    int err = bt_conn_le_param_update(conn, &presets[preset]);
+    if (err) {
+        LOG_ERR("bt_conn_le_param_update: %d", err);
+    }
 }
 K_WORK_DEFINE(conn_params_work, set_conn_params);
 
@@ -145,16 +214,27 @@ static uint8_t on_notify(struct bt_conn *conn,
 {
     if (!data) {
         return BT_GATT_ITER_STOP;
-    } else if (length != DAYDREAM_PKT_SIZE) {
+    }
+
+    COUNTER_INC(pkt_rx);
+
+    if (length != DAYDREAM_PKT_SIZE) {
+        COUNTER_INC(pkt_bad_len);
         LOG_HEXDUMP_ERR(data, length, "incorrect packet length");
         return BT_GATT_ITER_STOP;
     }
 
-    LOG_HEXDUMP_DBG(data, length, "notification");
+    if (IS_ENABLED(CONFIG_D2H_LOG_HOT_PATH)) {
+        LOG_HEXDUMP_DBG(data, length, "notification");
+    }
 
     int err = daydream_queue_pkt(data, K_MSEC(1));
     if (err) {
-        LOG_ERR("daydream_queue_pkt: %d", err);
+        static struct log_ratelimit queue_rl = {};
+        uint32_t n = log_ratelimit(&queue_rl);
+        if (n) {
+            LOG_ERR("daydream_queue_pkt: %d (x%u)", err, n);
+        }
     }
 
     return BT_GATT_ITER_CONTINUE;
@@ -199,8 +279,9 @@ static uint8_t on_gatt_svc_discover(struct bt_conn *conn,
             LOG_ERR("bt_gatt_subscribe: %d", err);
         } else {
             led_off(LED_BT_STATUS);
+            milestone_reached(MILESTONE_SUBSCRIBED);
         }
-        k_work_submit(&conn_params_work);
+        k_work_submit_to_queue(&housekeeping_q, &conn_params_work);
     }
 
     return BT_GATT_ITER_STOP;
@@ -208,18 +289,35 @@ static uint8_t on_gatt_svc_discover(struct bt_conn *conn,
 
 static void on_connected(struct bt_conn *conn, uint8_t status)
 {
+    if (!is_controller_conn(conn)) {
+        return;
+    }
+
     if (status) {
+        COUNTER_INC(conn_fail);
         LOG_WRN("Error %u", status);
         open_conn = NULL;
         mouse_reset();
         start_scan();
+        return;
     }
 
-    led_flash(150, 250, LED_BT_STATUS);
+    led_set(LED_BT_STATUS, LED_PATTERN_BLINK_FAST);
+    atomic_set(&conn_preset, CONN_PRESET_ACTIVE);
+    atomic_set(&link_robust, 0);
 
     int err;
     open_conn = bt_conn_ref(conn);
 
+    struct bt_conn_info info;
+    COUNTER_INC(connect);
+    if (!bt_conn_get_info(conn, &info)) {
+        on_le_param_updated(conn, info.le.interval, info.le.latency,
+            info.le.timeout);
+    }
+    link_connected();
+    gyro_bias_connected();
+
     err = bt_gatt_exchange_mtu(open_conn, &mtu_exchange_params);
     if (err) {
         LOG_ERR("bt_gatt_exchange_mtu: %d", err);
@@ -244,12 +342,49 @@ static void on_connected(struct bt_conn *conn, uint8_t status)
 
 static void on_disconnected(struct bt_conn *conn, uint8_t reason)
 {
+    if (conn != open_conn) {
+        return;
+    }
+
     LOG_WRN("Disconnected %u", reason);
+    COUNTER_INC(disconnect);
+    COUNTER_SET(link_interval, 0);
+    link_disconnected();
+    gyro_bias_disconnected();
+    bt_conn_unref(open_conn);
     open_conn = NULL;
     mouse_reset();
     start_scan();
 }
 
+static void on_le_param_updated(struct bt_conn *conn, uint16_t interval,
+    uint16_t latency, uint16_t timeout)
+{
+    if (conn != open_conn) {
+        return;
+    }
+
+    /* in the controller's units: 1.25 ms, events, and 10 ms */
+    COUNTER_SET(link_interval, interval);
+    COUNTER_SET(link_latency, latency);
+    COUNTER_SET(link_timeout, timeout);
+    LOG_INF("Connection parameters: interval %u latency %u timeout %u",
+        interval, latency, timeout);
+}
+
+#if defined(CONFIG_D2H_LINK_MONITOR)
+static void on_le_phy_updated(struct bt_conn *conn,
+    struct bt_conn_le_phy_info *param)
+{
+    if (conn != open_conn) {
+        return;
+    }
+
+    LOG_INF("PHY updated: TX %u RX %u", param->tx_phy, param->rx_phy);
+    link_phy_updated(param->rx_phy);
+}
+#endif
+
 static void on_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
 {
     LOG_INF("Updated MTU: TX: %d RX: %d bytes\n", tx, rx);
@@ -261,26 +396,74 @@ static void on_gatt_exchange_mtu(struct bt_conn *conn, uint8_t err,
     LOG_INF("on_gatt_exchange_mtu err=%u", err);
 }
 
+void bluetooth_refresh_conn_params()
+{
+    if (open_conn) {
+        k_work_submit_to_queue(&housekeeping_q, &conn_params_work);
+    }
+}
+
+void bluetooth_set_conn_preset(enum conn_preset preset)
+{
+    if (atomic_set(&conn_preset, preset) != preset) {
+        link_set_idle(preset == CONN_PRESET_IDLE);
+        bluetooth_refresh_conn_params();
+    }
+}
+
 int bluetooth_is_connected()
 {
     return open_conn != NULL;
 }
 
-int boot_bluetooth()
+struct bt_conn *bluetooth_conn_ref()
 {
-    int err;
+    struct bt_conn *conn = open_conn;
+    return conn ? bt_conn_ref(conn) : NULL;
+}
 
-    led_on(LED_BT_STATUS);
+void bluetooth_set_link_robust(bool robust)
+{
+    if (atomic_set(&link_robust, robust) != robust) {
+        bluetooth_refresh_conn_params();
+    }
+}
 
-    err = bt_enable(NULL);
+static void on_bt_ready(int err)
+{
     if (err) {
         LOG_ERR("Bluetooth init failed: %d", err);
-        return err;
+        led_off(LED_BT_STATUS);
+        return;
     }
 
+    milestone_reached(MILESTONE_BT_READY);
+
     bt_gatt_cb_register(&gatt_callbacks);
 
+    if (IS_ENABLED(CONFIG_BT_SETTINGS)) {
+        err = settings_load_subtree("bt");
+        if (err) {
+            LOG_ERR("settings_load_subtree: %d", err);
+        }
+    }
+
+    gyro_bias_bt_ready();
     start_scan();
+    hog_bt_ready();
+}
+
+int boot_bluetooth()
+{
+    int err;
+
+    led_on(LED_BT_STATUS);
+
+    err = bt_enable(on_bt_ready);
+    if (err) {
+        LOG_ERR("bt_enable: %d", err);
+        return err;
+    }
 
     return err;
 }
@@ -0,0 +1,72 @@
+#include "main.h"
+#include <string.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+/*
+ * Counters live in a stats subsystem group, so anything that already reads
+ * stats groups (mcumgr, for one) sees them, and are also copied out as a HID
+ * feature report so a host can poll them over the mouse's own interface.
+ *
+ * The counters are plain 32-bit fields, not atomics. Most have a single
+ * writer, but report_merged and report_dropped are bumped from both the
+ * decoder and main; that's only safe because both are cooperative threads on
+ * a single core, so neither can preempt the other halfway through an
+ * increment. Readers may see a slightly stale set but never a torn value.
+ */
+
+#define COUNTER_NAME(name_) STATS_NAME(d2h_stats, name_)
+#define COUNTER_COPY(name_) report.name_ = d2h_stats.name_;
+
+
+LOG_MODULE_REGISTER(counters, CONFIG_D2H_MAIN_LOG_LEVEL);
+
+STATS_SECT_DECL(d2h_stats) d2h_stats;
+
+STATS_NAME_START(d2h_stats)
+D2H_COUNTERS(COUNTER_NAME)
+STATS_NAME_END(d2h_stats);
+
+
+int counters_get_report(uint8_t *buf, size_t len)
+{
+    struct counters_report report = {
+        .version = COUNTERS_VERSION,
+        .uptime_sec = k_uptime_get() / 1000,
+    };
+
+    if (len < sizeof(report)) {
+        return -ENOMEM;
+    }
+
+    D2H_COUNTERS(COUNTER_COPY)
+
+    memcpy(buf, &report, sizeof(report));
+    return sizeof(report);
+}
+
+int boot_counters()
+{
+    /* this zeroes the counters, so it has to run before anything counts */
+    int err = STATS_INIT_AND_REG(d2h_stats, STATS_SIZE_32, "d2h");
+    if (err) {
+        LOG_ERR("stats_init_and_reg: %d", err);
+    }
+
+    return err;
+}
+
+#if defined(CONFIG_D2H_SHELL)
+#define COUNTER_PRINT(name_) \
+    shell_print(sh, "%-18s %u", #name_, d2h_stats.name_);
+
+static int cmd_counters(const struct shell *sh, size_t argc, char **argv)
+{
+    D2H_COUNTERS(COUNTER_PRINT)
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), counters, NULL, "Health counters", cmd_counters, 1, 0);
+#endif
@@ -0,0 +1,138 @@
+#include "main.h"
+#include <math.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Pointer acceleration curves, precomputed into a lookup table of gain versus
+ * speed so that evaluating one is a table lookup, an interpolation and a
+ * multiply.
+ *
+ * Speed is in counts per millisecond (Q8), gain is in output counts per
+ * unit of speed (Q16). Table entry i is the gain at speed i << lut->shift.
+ */
+
+#define CURVE_DURATION_MAX 64
+
+/* Packet spacing, in ms, at which CURVE_CLASSIC matches the original
+ * per-packet linear-plus-quadratic formula exactly */
+#define CURVE_NOMINAL_DURATION 15
+
+#define CURVE_SIGMOID_MID (CURVE_LUT_SIZE / 4)
+#define CURVE_SIGMOID_WIDTH (CURVE_LUT_SIZE / 16)
+
+struct curve_point {
+    uint8_t idx;
+    uint16_t gain_q8;
+};
+
+
+#define RECIP_Q16(d_, _) ((d_) ? 65536 / (d_) : 0)
+
+static const uint32_t recip_q16[CURVE_DURATION_MAX] = {
+    LISTIFY(CURVE_DURATION_MAX, RECIP_Q16, (,))
+};
+
+/* Windows-style stepped acceleration, as multiples of the base gain, over the
+ * table's speed range */
+static const struct curve_point windows_points[] = {
+    { 0, 256 },
+    { 4, 256 },
+    { 12, 512 },
+    { 24, 768 },
+    { CURVE_LUT_SIZE - 1, 896 },
+};
+
+
+static uint32_t gain_at(uint32_t velocity, uint32_t acceleration,
+    uint32_t in_max, uint32_t speed_q8)
+{
+    uint64_t gain = velocity;
+    gain += (uint64_t)speed_q8 * CURVE_NOMINAL_DURATION * acceleration / 256;
+    return (gain << 16) / in_max;
+}
+
+static void build_piecewise(struct curve_lut *lut, uint32_t base_q16,
+    struct curve_point const *points, size_t npoints)
+{
+    size_t seg = 0;
+
+    for (size_t i = 0; i < CURVE_LUT_SIZE; ++i) {
+        while (seg + 2 < npoints && i > points[seg + 1].idx) {
+            seg += 1;
+        }
+
+        struct curve_point const *a = &points[seg];
+        struct curve_point const *b = &points[seg + 1];
+        int32_t span = b->idx - a->idx;
+        int32_t pos = MINMAX(0, (int32_t)i - a->idx, span);
+        int32_t mult_q8 = a->gain_q8 + (b->gain_q8 - a->gain_q8) * pos / span;
+
+        lut->gain[i] = (uint64_t)base_q16 * mult_q8 / 256;
+    }
+}
+
+void curve_build(struct curve_lut *lut, enum curve_type type, uint8_t shift,
+    uint16_t velocity, uint16_t acceleration, uint16_t in_max)
+{
+    uint32_t base = gain_at(velocity, 0, in_max, 0);
+    uint32_t top = gain_at(velocity, acceleration, in_max,
+        (CURVE_LUT_SIZE - 1) << shift);
+
+    lut->shift = shift;
+
+    switch (type) {
+    case CURVE_LINEAR:
+        for (size_t i = 0; i < CURVE_LUT_SIZE; ++i) {
+            lut->gain[i] = base;
+        }
+        break;
+    case CURVE_WINDOWS:
+        build_piecewise(lut, base, windows_points, ARRAY_SIZE(windows_points));
+        break;
+    case CURVE_SIGMOID:
+        /* same end points as the classic curve, but flat at both ends */
+        for (size_t i = 0; i < CURVE_LUT_SIZE; ++i) {
+            float x = ((float)i - CURVE_SIGMOID_MID) / CURVE_SIGMOID_WIDTH;
+            float s = 1.0f / (1.0f + expf(-x));
+            lut->gain[i] = base + (uint32_t)((float)(top - base) * s);
+        }
+        break;
+    case CURVE_CLASSIC:
+    default:
+        for (size_t i = 0; i < CURVE_LUT_SIZE; ++i) {
+            lut->gain[i] = gain_at(velocity, acceleration, in_max, i << shift);
+        }
+        break;
+    }
+}
+
+int32_t curve_apply(struct curve_lut const *lut, int delta, int duration)
+{
+    uint32_t mag = delta < 0 ? -delta : delta;
+    uint32_t speed = (mag * curve_recip(duration)) >> 8;
+    uint32_t idx = speed >> lut->shift;
+    uint32_t gain;
+
+    if (idx >= CURVE_LUT_SIZE - 1) {
+        gain = lut->gain[CURVE_LUT_SIZE - 1];
+    } else {
+        uint32_t frac = speed & BIT_MASK(lut->shift);
+        int64_t step = (int64_t)lut->gain[idx + 1] - lut->gain[idx];
+        gain = lut->gain[idx] + ((step * frac) >> lut->shift);
+    }
+
+    int64_t out = ((uint64_t)speed * gain) >> 8;
+    out = MIN(out, CURVE_OUT_MAX);
+    return delta < 0 ? -(int32_t)out : (int32_t)out;
+}
+
+uint32_t curve_recip(int duration)
+{
+    if (duration >= CURVE_DURATION_MAX) {
+        /* the first packet after a gap; clamping it would overstate the
+         * speed by duration / CURVE_DURATION_MAX */
+        return 65536 / duration;
+    }
+
+    return recip_q16[MAX(1, duration)];
+}
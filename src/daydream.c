@@ -1,148 +1,130 @@
 #include "main.h"
 #include <zephyr/logging/log.h>
-#include <zephyr/sys/__assert.h>
-LOG_MODULE_REGISTER(daydream, LOG_LEVEL_DBG);
+#include <string.h>
+LOG_MODULE_REGISTER(daydream, CONFIG_D2H_DAYDREAM_LOG_LEVEL);
 
 #define DAYDREAM_THREAD_STACK_SIZE 1024
-#define DAYDREAM_THREAD_PRIORITY 0
+#define DAYDREAM_THREAD_PRIORITY CONFIG_D2H_DECODE_THREAD_PRIORITY
+#define DAYDREAM_QUEUE_LEN 8
+/* never more than the queue holds, so a batch can't chase a busy link */
+#define DAYDREAM_BATCH_MAX DAYDREAM_QUEUE_LEN
 
 
-K_MSGQ_DEFINE(daydream_pkt_queue, DAYDREAM_PKT_SIZE, 8, sizeof(void*));
+struct daydream_rx {
+    uint32_t rx_cycles;
+    uint8_t data[DAYDREAM_PKT_SIZE];
+};
 
+/* owned by the decoder thread */
+struct decoder {
+    struct packet_decoder packet;
+    struct log_ratelimit gap_rl;
+};
 
-int daydream_queue_pkt(uint8_t const *pkt, k_timeout_t timeout)
-{
-    return k_msgq_put(&daydream_pkt_queue, pkt, timeout);
-}
 
-static uint32_t decode_inner(uint8_t *pkt, size_t *nbitsp,
-    size_t start_byte, size_t start_bit, size_t end_byte, size_t end_bit)
-{
-    uint32_t result = 0;
+K_MSGQ_DEFINE(daydream_pkt_queue, sizeof(struct daydream_rx), DAYDREAM_QUEUE_LEN,
+    sizeof(void*));
 
-    for (size_t i = start_byte; i <= end_byte; ++i) {
-        result <<= 8;
-        result |= pkt[i];
-    }
 
-    uint32_t const nbits = ((end_byte - start_byte) * 8) + start_bit - end_bit;
-    uint32_t const mask = (1u << nbits) - 1u;
+int daydream_queue_pkt(uint8_t const *pkt, k_timeout_t timeout)
+{
+    /* always stamped, the link monitor needs it for jitter */
+    struct daydream_rx rx = { .rx_cycles = k_cycle_get_32() };
 
-    __ASSERT(nbits < 32, "decode_inner nbits <= 32");
+    memcpy(rx.data, pkt, DAYDREAM_PKT_SIZE);
 
-    if (nbitsp) {
-        *nbitsp = nbits;
+    int err = k_msgq_put(&daydream_pkt_queue, &rx, timeout);
+    if (err) {
+        COUNTER_INC(pkt_queue_overrun);
     }
-
-    result >>= end_bit;
-    result &= mask;
-
-    return result;
+    perf_queue_depth(PERF_QUEUE_DAYDREAM, k_msgq_num_used_get(&daydream_pkt_queue));
+    return err;
 }
 
-static unsigned decode_unsigned(uint8_t *pkt,
-    size_t start_byte, size_t start_bit, size_t end_byte, size_t end_bit)
+uint32_t daydream_queue_used()
 {
-    return decode_inner(pkt, NULL,
-        start_byte, start_bit, end_byte, end_bit);
+    return k_msgq_num_used_get(&daydream_pkt_queue);
 }
 
-static int decode_twos_complement(uint8_t *pkt,
-    size_t start_byte, size_t start_bit, size_t end_byte, size_t end_bit)
+uint32_t daydream_queue_size()
 {
-    size_t nbits = 0;
-    uint32_t decoded = decode_inner(pkt, &nbits,
-        start_byte, start_bit, end_byte, end_bit);
-
-    __ASSERT(nbits > 0, "decode_twos_complement nbits > 0");
-    __ASSERT(nbits < 32, "decode_twos_complement nbits < 32");
+    return daydream_pkt_queue.max_msgs;
+}
 
-    uint32_t const signmask = 1u << (nbits - 1);
+/* Decode one packet into dec->packet.pkt. Returns false for the first packet after a
+ * reset, which only seeds the timestamp and sequence number. */
+static bool decode_pkt(struct decoder *dec, struct daydream_rx const *rx)
+{
+    unsigned lost;
 
-    int result;
+    if (!packet_decode(&dec->packet, rx->data, &lost)) {
+        return false;
+    }
 
-    if (decoded & signmask) {
-        uint32_t const mask = (1u << nbits) - 1u;
-        // result = 1;
-        result = (~decoded & mask);
-        result += 1;
-        result = -result;
-    } else {
-        result = decoded;
+    if (lost) {
+        COUNTER_INC(sqn_gap);
+        COUNTER_ADD(pkt_lost, lost);
+        uint32_t n = log_ratelimit(&dec->gap_rl);
+        if (n) {
+            unsigned sqn = dec->packet.pkt.sqn;
+            LOG_WRN("Dropped packet? prev_sqn=%u sqn=%u (x%u)",
+                (sqn - lost - 1) % 32, sqn, n);
+        }
     }
 
-    return result;
+    dec->packet.pkt.rx_cycles = rx->rx_cycles;
+    link_pkt(&dec->packet.pkt, lost);
+    return true;
 }
 
 static int daydream_decode(void *_a, void *_b, void *_c)
 {
-    bool has_initial = false;
-    unsigned prev_timestamp;
-
-    uint8_t pkt[DAYDREAM_PKT_SIZE];
-    struct daydream_pkt decoded = {};
+    struct decoder dec = {};
+    struct daydream_rx rx;
+    struct log_ratelimit timeout_rl = {};
+    uint32_t n;
     int err;
 
     for (;;) {
-        err = k_msgq_get(&daydream_pkt_queue, pkt, K_MSEC(500));
+        err = k_msgq_get(&daydream_pkt_queue, &rx, K_MSEC(500));
         if (!bluetooth_is_connected()) {
             k_msgq_purge(&daydream_pkt_queue);
+            dec.packet.has_initial = false;
             continue;
         }
 
         if (err == -EAGAIN && bluetooth_is_connected()) {
-            LOG_WRN("Packet timeout");
+            COUNTER_INC(pkt_timeout);
+            n = log_ratelimit(&timeout_rl);
+            if (n) {
+                LOG_WRN("Packet timeout (x%u)", n);
+            }
             continue;
         } else if (err) {
             LOG_ERR("k_msgq_get: %d", err);
             continue;
         }
 
-        unsigned sqn = decode_unsigned(pkt, 1, 7, 1, 2);
-        unsigned timestamp = decode_unsigned(pkt, 0, 8, 1, 7);
-
-        if (has_initial) {
-            if ((decoded.sqn + 1) % 32 != sqn) {
-                LOG_WRN("Dropped packet? prev_sqn=%u sqn=%u", decoded.sqn, sqn);
-            }
-
-            if (timestamp <= prev_timestamp) {
-                decoded.duration = 512 - prev_timestamp + timestamp;
-            } else {
-                decoded.duration = timestamp - prev_timestamp;
-            }
-
-            decoded.orient_x = decode_twos_complement(pkt, 1, 2, 3, 5);
-            decoded.orient_z = decode_twos_complement(pkt, 3, 5, 4, 0);
-            decoded.orient_y = -decode_twos_complement(pkt, 5, 8, 6, 3);
-
-            decoded.accel_x = decode_twos_complement(pkt, 6, 3, 8, 6);
-            decoded.accel_z = decode_twos_complement(pkt, 8, 6, 9, 1);
-            decoded.accel_y = -decode_twos_complement(pkt, 9, 1, 11, 4);
-
-            decoded.gyro_x = decode_twos_complement(pkt, 11, 4, 13, 7);
-            decoded.gyro_z = decode_twos_complement(pkt, 13, 7, 14, 2);
-            decoded.gyro_y = -decode_twos_complement(pkt, 14, 2, 16, 5);
-
-            decoded.trackpad_x = decode_unsigned(pkt, 16, 5, 17, 5);
-            decoded.trackpad_y = decode_unsigned(pkt, 17, 5, 18, 5);
-
-            decoded.sqn = sqn;
-
-            decoded.vol_up = (pkt[18] & 0x10) != 0;
-            decoded.vol_dn = (pkt[18] & 0x08) != 0;
-            decoded.app = (pkt[18] & 0x04) != 0;
-            decoded.home = (pkt[18] & 0x02) != 0;
-            decoded.trackpad_btn = (pkt[18] & 0x01) != 0;
-
-            err = mouse_push_daydream(&decoded);
-            if (err) {
-                LOG_ERR("mouse_push_daydream: %d", err);
+        /*
+         * A connection event can deliver several notifications back to back.
+         * Take everything that's already queued while we're awake, and hand
+         * the motion on as a single report at the end.
+         */
+        uint32_t batch = 0;
+        do {
+            uint32_t decode_start = perf_now();
+            bool decoded = decode_pkt(&dec, &rx);
+            perf_stage_add(PERF_STAGE_DECODE, decode_start);
+
+            if (decoded) {
+                /* failures are already logged, rate limited, by the mouse */
+                mouse_push_daydream(&dec.packet.pkt);
             }
-        }
+            batch += 1;
+        } while (batch < DAYDREAM_BATCH_MAX &&
+            !k_msgq_get(&daydream_pkt_queue, &rx, K_NO_WAIT));
 
-        has_initial = true;
-        prev_timestamp = timestamp;
+        perf_batch(batch, mouse_flush());
     }
 
     return 0;
@@ -0,0 +1,120 @@
+#include "main.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+/*
+ * One Euro filter (Casiez, Roussel, Vogel 2012) in fixed point.
+ *
+ * A low-pass filter whose cutoff rises with the (low-pass filtered) speed of
+ * the signal: at rest the cutoff is low and sensor noise is smoothed out, and
+ * during fast motion the cutoff is high so the filter adds little lag.
+ *
+ * Values are Q8, derivatives are Q8 units per second, cutoffs are in mHz.
+ */
+
+#define FILTER_DCUTOFF_MHZ 1000
+#define FILTER_MAX_CUTOFF_MHZ 1000000
+#define FILTER_MAX_DX_Q8 (INT32_MAX / 2)
+
+/* 1e9 / (2 * pi): time constant in us of a 1 mHz cutoff */
+#define FILTER_TAU_US_MHZ 159154943u
+
+
+static struct filter_stats stats[FILTER_AXIS_COUNT] = {};
+
+
+static int32_t alpha_q16(uint32_t te_us, uint32_t cutoff_mhz)
+{
+    uint32_t tau_us = FILTER_TAU_US_MHZ / MAX(cutoff_mhz, 1);
+    return ((uint64_t)te_us << 16) / (te_us + tau_us);
+}
+
+static int32_t smooth(int32_t prev, int32_t next, int32_t alpha)
+{
+    return prev + (int32_t)((((int64_t)next - prev) * alpha) >> 16);
+}
+
+int filter_apply(struct euro_filter *f, enum filter_axis axis,
+    uint16_t min_cutoff_mhz, uint16_t beta, int x, int duration)
+{
+    int32_t x_q8 = x * 256;
+
+    if (!min_cutoff_mhz) {
+        return x;
+    }
+
+    if (!f->init) {
+        f->init = true;
+        f->x_q8 = x_q8;
+        f->dx_q8 = 0;
+        f->prev_raw = x;
+        return x;
+    }
+
+    uint32_t te_us = MAX(duration, 1) * 1000;
+
+    int64_t dx_q8 = ((int64_t)x_q8 - f->x_q8) * 1000 / MAX(duration, 1);
+    dx_q8 = MINMAX(-FILTER_MAX_DX_Q8, dx_q8, FILTER_MAX_DX_Q8);
+    f->dx_q8 = smooth(f->dx_q8, dx_q8, alpha_q16(te_us, FILTER_DCUTOFF_MHZ));
+
+    uint64_t cutoff_mhz = min_cutoff_mhz +
+        (((uint64_t)beta * abs(f->dx_q8)) >> 8);
+    cutoff_mhz = MIN(cutoff_mhz, FILTER_MAX_CUTOFF_MHZ);
+    int32_t prev_q8 = f->x_q8;
+    f->x_q8 = smooth(f->x_q8, x_q8, alpha_q16(te_us, cutoff_mhz));
+
+    int out = (f->x_q8 + 128) >> 8;
+
+    struct filter_stats *st = &stats[axis];
+    st->samples += 1;
+    st->raw_variation += abs(x - f->prev_raw);
+    st->out_variation += abs(out - ((prev_q8 + 128) >> 8));
+    st->lag += abs(x - out);
+    f->prev_raw = x;
+
+    return out;
+}
+
+void filter_reset(struct euro_filter *f)
+{
+    f->init = false;
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static const char *axis_names[FILTER_AXIS_COUNT] = {
+    [FILTER_TRACKPAD_X] = "trackpad_x",
+    [FILTER_TRACKPAD_Y] = "trackpad_y",
+    [FILTER_GYRO_X] = "gyro_x",
+    [FILTER_GYRO_Z] = "gyro_z",
+};
+
+static int cmd_filter(const struct shell *sh, size_t argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "clear")) {
+        memset(stats, 0, sizeof(stats));
+        return 0;
+    }
+
+    shell_print(sh, "%-12s %8s %10s %10s %8s", "axis", "samples",
+        "raw var", "out var", "avg lag");
+
+    for (size_t i = 0; i < FILTER_AXIS_COUNT; ++i) {
+        struct filter_stats const *st = &stats[i];
+        shell_print(sh, "%-12s %8u %10llu %10llu %8llu", axis_names[i],
+            st->samples,
+            (unsigned long long)st->raw_variation,
+            (unsigned long long)st->out_variation,
+            (unsigned long long)(st->samples ? st->lag / st->samples : 0));
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), filter, NULL,
+    "Jitter filter statistics: total variation of the raw and filtered\n"
+    "signals, and the average distance between them\n"
+    "Usage: filter [clear]",
+    cmd_filter, 1, 1);
+#endif
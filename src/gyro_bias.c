@@ -0,0 +1,374 @@
+#include "main.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+/*
+ * Gyro zero-rate offset (bias) estimation.
+ *
+ * Every packet's gyro and accelerometer readings go into a window (see
+ * bias_window.c). Once CONFIG_D2H_GYRO_BIAS_WINDOW packets are in, low
+ * variance on every axis means the controller was lying still, so the
+ * window's mean gyro rate is its bias, and the estimate moves part of the way
+ * towards it. A window with any motion in it is thrown away.
+ *
+ * Turning slowly at a constant rate also has low gyro variance, and turning
+ * about the vertical axis doesn't move the accelerometer either, so a mean
+ * above CONFIG_D2H_GYRO_BIAS_MAX isn't taken as bias.
+ *
+ * Estimates are kept per bonded controller under d2h/gyro/<address>, so a
+ * controller that reconnects starts out calibrated, and are deleted along
+ * with the bond. They're saved at most every CONFIG_D2H_GYRO_BIAS_SAVE_SEC
+ * while they move, and on disconnect.
+ */
+
+#define GYRO_BIAS_KEY_PREFIX "d2h/gyro/"
+#define GYRO_BIAS_KEY_LEN (sizeof(GYRO_BIAS_KEY_PREFIX) + 2 * sizeof(bt_addr_t) + 3)
+/* an estimate this far (Q8 counts) from the stored one is worth saving */
+#define GYRO_BIAS_SAVE_DELTA_Q8 256
+
+enum bias_source {
+    SOURCE_NONE,
+    SOURCE_STORED,
+    SOURCE_ESTIMATED,
+};
+
+struct bias_record {
+    int32_t bias_q8[BIAS_GYRO_AXIS_COUNT];
+};
+
+struct bias_load {
+    struct bias_record rec;
+    bool found;
+};
+
+/* an estimate waiting to be saved, and whose it is */
+struct bias_pending {
+    bt_addr_le_t addr;
+    struct bias_record rec;
+    bool valid;
+};
+
+
+static void bias_load_handler(struct k_work *work);
+static void bias_save_handler(struct k_work *work);
+static void on_bond_deleted(uint8_t id, const bt_addr_le_t *peer);
+
+
+LOG_MODULE_REGISTER(gyro_bias, CONFIG_D2H_GYRO_BIAS_LOG_LEVEL);
+K_WORK_DEFINE(bias_load_work, bias_load_handler);
+K_WORK_DELAYABLE_DEFINE(bias_save_work, bias_save_handler);
+
+/* the decoder and BT threads preempt the housekeeping queue, which loads and
+ * saves the estimate, so everything below is only touched under the lock */
+static struct k_spinlock lock;
+static struct bias_window window = {};
+static struct bias_record estimate = {};
+static struct bias_record saved = {};
+static enum bias_source source = SOURCE_NONE;
+static bool dirty = false;
+/* the controller the estimate belongs to, while it's connected */
+static bt_addr_le_t owner;
+static bool connected = false;
+static uint32_t session = 0;
+/* what the last controller left behind when it disconnected */
+static struct bias_pending pending = {};
+
+/* for the shell */
+static uint32_t still_windows = 0;
+static uint32_t moving_windows = 0;
+static int32_t residual_q8[BIAS_GYRO_AXIS_COUNT] = {};
+static uint32_t variance[BIAS_AXIS_COUNT] = {};
+
+static struct bt_conn_auth_info_cb auth_info_cbs = {
+    .bond_deleted = on_bond_deleted,
+};
+
+
+static void bias_key(char *key, size_t len, bt_addr_le_t const *addr)
+{
+    snprintk(key, len, GYRO_BIAS_KEY_PREFIX "%02x%02x%02x%02x%02x%02x%u",
+        addr->a.val[5], addr->a.val[4], addr->a.val[3],
+        addr->a.val[2], addr->a.val[1], addr->a.val[0], addr->type);
+}
+
+/* called with the lock held, once a window is full. Returns whether the
+ * estimate has moved far enough to be worth saving. */
+static bool window_done()
+{
+    bool save = false;
+
+    if (!bias_window_is_still(&window, variance)) {
+        moving_windows += 1;
+        return false;
+    }
+
+    still_windows += 1;
+    bias_window_correct(&window, source == SOURCE_NONE, estimate.bias_q8,
+        residual_q8);
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        save = save || abs(estimate.bias_q8[i] - saved.bias_q8[i]) >=
+            GYRO_BIAS_SAVE_DELTA_Q8;
+    }
+
+    if (source == SOURCE_NONE) {
+        LOG_INF("First gyro bias estimate: %d %d %d (Q8)",
+            estimate.bias_q8[BIAS_GYRO_X], estimate.bias_q8[BIAS_GYRO_Y],
+            estimate.bias_q8[BIAS_GYRO_Z]);
+        save = true;
+    }
+    source = SOURCE_ESTIMATED;
+
+    dirty = dirty || save;
+    return save;
+}
+
+void gyro_bias_update(struct daydream_pkt const *pkt)
+{
+    int32_t const sample[BIAS_AXIS_COUNT] = {
+        [BIAS_GYRO_X] = pkt->gyro_x,
+        [BIAS_GYRO_Y] = pkt->gyro_y,
+        [BIAS_GYRO_Z] = pkt->gyro_z,
+        [BIAS_ACCEL_X] = pkt->accel_x,
+        [BIAS_ACCEL_Y] = pkt->accel_y,
+        [BIAS_ACCEL_Z] = pkt->accel_z,
+    };
+
+    bool save = false;
+    k_spinlock_key_t k = k_spin_lock(&lock);
+
+    bias_window_add(&window, sample);
+    if (window.n >= CONFIG_D2H_GYRO_BIAS_WINDOW) {
+        save = window_done();
+        window = (struct bias_window){};
+    }
+
+    k_spin_unlock(&lock, k);
+
+    if (save) {
+        /* doesn't move a save that's already scheduled, so this is also
+         * the rate limit */
+        k_work_schedule_for_queue(&housekeeping_q, &bias_save_work,
+            K_SECONDS(CONFIG_D2H_GYRO_BIAS_SAVE_SEC));
+    }
+}
+
+struct gyro_bias gyro_bias_get()
+{
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    struct gyro_bias bias = {
+        .x = (estimate.bias_q8[BIAS_GYRO_X] + 128) >> 8,
+        .y = (estimate.bias_q8[BIAS_GYRO_Y] + 128) >> 8,
+        .z = (estimate.bias_q8[BIAS_GYRO_Z] + 128) >> 8,
+    };
+    k_spin_unlock(&lock, k);
+
+    return bias;
+}
+
+void gyro_bias_connected()
+{
+    struct bt_conn *conn = bluetooth_conn_ref();
+    bt_addr_le_t addr = {};
+    if (conn) {
+        addr = *bt_conn_get_dst(conn);
+        bt_conn_unref(conn);
+    }
+
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    window = (struct bias_window){};
+    estimate = (struct bias_record){};
+    saved = estimate;
+    source = SOURCE_NONE;
+    dirty = false;
+    owner = addr;
+    connected = conn != NULL;
+    session += 1;
+    k_spin_unlock(&lock, k);
+
+    k_work_submit_to_queue(&housekeeping_q, &bias_load_work);
+}
+
+void gyro_bias_disconnected()
+{
+    /* hand the estimate over now, so a reconnect that comes in before the
+     * save runs can't reset it first */
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    if (connected && dirty) {
+        pending.addr = owner;
+        pending.rec = estimate;
+        pending.valid = true;
+        saved = estimate;
+        dirty = false;
+    }
+    connected = false;
+    k_spin_unlock(&lock, k);
+
+    k_work_reschedule_for_queue(&housekeeping_q, &bias_save_work, K_NO_WAIT);
+}
+
+void gyro_bias_bt_ready()
+{
+    int err = bt_conn_auth_info_cb_register(&auth_info_cbs);
+    if (err) {
+        LOG_ERR("bt_conn_auth_info_cb_register: %d", err);
+    }
+}
+
+static int bias_load_cb(const char *name, size_t len, settings_read_cb read_cb,
+    void *cb_arg, void *param)
+{
+    struct bias_load *load = param;
+
+    if (len != sizeof(load->rec)) {
+        LOG_WRN("Ignoring stored gyro bias (%zu bytes)", len);
+        return 0;
+    }
+
+    int ret = read_cb(cb_arg, &load->rec, sizeof(load->rec));
+    if (ret < 0) {
+        return ret;
+    }
+
+    load->found = true;
+    return 0;
+}
+
+static void bias_load_handler(struct k_work *work)
+{
+    struct bias_load load = {};
+    char key[GYRO_BIAS_KEY_LEN];
+
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    bt_addr_le_t addr = owner;
+    uint32_t load_session = session;
+    bool wanted = connected;
+    k_spin_unlock(&lock, k);
+
+    if (!wanted) {
+        return;
+    }
+
+    bias_key(key, sizeof(key), &addr);
+    int err = settings_load_subtree_direct(key, bias_load_cb, &load);
+    if (err) {
+        LOG_ERR("settings_load_subtree_direct: %d", err);
+        return;
+    }
+    if (!load.found) {
+        LOG_INF("No stored gyro bias for this controller");
+        return;
+    }
+
+    /* an estimate made since connecting is fresher than the stored one, and
+     * one loaded for a controller that has since gone is no use */
+    k = k_spin_lock(&lock);
+    if (session == load_session && source == SOURCE_NONE) {
+        estimate = load.rec;
+        saved = load.rec;
+        source = SOURCE_STORED;
+    }
+    k_spin_unlock(&lock, k);
+
+    LOG_INF("Loaded gyro bias: %d %d %d (Q8)", load.rec.bias_q8[BIAS_GYRO_X],
+        load.rec.bias_q8[BIAS_GYRO_Y], load.rec.bias_q8[BIAS_GYRO_Z]);
+}
+
+static void bias_save(struct bias_pending const *p)
+{
+    char key[GYRO_BIAS_KEY_LEN];
+
+    /* a controller that never bonded would leave its estimate behind for
+     * good, since nothing ever deletes it */
+    if (!bt_le_bond_exists(BT_ID_DEFAULT, &p->addr)) {
+        LOG_DBG("Not saving gyro bias for an unbonded controller");
+        return;
+    }
+
+    bias_key(key, sizeof(key), &p->addr);
+    int err = settings_save_one(key, &p->rec, sizeof(p->rec));
+    if (err) {
+        LOG_ERR("settings_save_one: %d", err);
+    }
+}
+
+static void bias_save_handler(struct k_work *work)
+{
+    struct bias_pending current = {};
+
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    struct bias_pending left = pending;
+    pending.valid = false;
+    if (connected && dirty) {
+        current.addr = owner;
+        current.rec = estimate;
+        current.valid = true;
+        saved = estimate;
+        dirty = false;
+    }
+    k_spin_unlock(&lock, k);
+
+    if (left.valid) {
+        bias_save(&left);
+    }
+    if (current.valid) {
+        bias_save(&current);
+    }
+}
+
+static void on_bond_deleted(uint8_t id, const bt_addr_le_t *peer)
+{
+    char key[GYRO_BIAS_KEY_LEN];
+
+    if (id != BT_ID_DEFAULT) {
+        return;
+    }
+
+    bias_key(key, sizeof(key), peer);
+    int err = settings_delete(key);
+    if (err) {
+        LOG_ERR("settings_delete: %d", err);
+    }
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static const char *source_names[] = {
+    [SOURCE_NONE] = "none",
+    [SOURCE_STORED] = "stored",
+    [SOURCE_ESTIMATED] = "estimated",
+};
+
+static int cmd_gyro(const struct shell *sh, size_t argc, char **argv)
+{
+    k_spinlock_key_t k = k_spin_lock(&lock);
+    struct bias_record rec = estimate;
+    enum bias_source src = source;
+    int32_t residual[BIAS_GYRO_AXIS_COUNT];
+    uint32_t var[BIAS_AXIS_COUNT];
+    memcpy(residual, residual_q8, sizeof(residual));
+    memcpy(var, variance, sizeof(var));
+    k_spin_unlock(&lock, k);
+
+    shell_print(sh, "bias (%s): x %d y %d z %d (1/256 counts)",
+        source_names[src], rec.bias_q8[BIAS_GYRO_X],
+        rec.bias_q8[BIAS_GYRO_Y], rec.bias_q8[BIAS_GYRO_Z]);
+    shell_print(sh, "windows: %u still, %u moving", still_windows,
+        moving_windows);
+    shell_print(sh, "last still window residual: x %d y %d z %d (1/256 counts)",
+        residual[BIAS_GYRO_X], residual[BIAS_GYRO_Y], residual[BIAS_GYRO_Z]);
+    shell_print(sh, "last window variance: gyro %u %u %u, accel %u %u %u",
+        var[BIAS_GYRO_X], var[BIAS_GYRO_Y], var[BIAS_GYRO_Z],
+        var[BIAS_ACCEL_X], var[BIAS_ACCEL_Y], var[BIAS_ACCEL_Z]);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), gyro, NULL,
+    "Gyro bias estimate, and the drift left over after correcting for it",
+    cmd_gyro, 1, 0);
+#endif
@@ -0,0 +1,121 @@
+#include "main.h"
+#include <zephyr/usb/class/hid.h>
+
+/*
+ * The HID report descriptor, shared by the USB and BLE (HID over GATT)
+ * transports so the host sees the same reports either way. It is generated
+ * from HID_REPORTS in main.h: each input report gets a mouse application
+ * collection of its own, and the feature reports share one vendor-defined
+ * collection.
+ */
+
+#define HID_USAGE_PAGE_VENDOR(page_) \
+    HID_ITEM(HID_ITEM_TAG_USAGE_PAGE, HID_ITEM_TYPE_GLOBAL, 2), \
+    (page_) & 0xff, (page_) >> 8
+
+#define HID_FIELD_DESC(kind_, name_, ...) HID_FIELD_DESC_##kind_(__VA_ARGS__)
+
+#define HID_FIELD_DESC_BUTTONS(count_) \
+    HID_USAGE_PAGE(HID_USAGE_GEN_BUTTON), \
+    HID_USAGE_MIN8(1), \
+    HID_USAGE_MAX8(count_), \
+    HID_LOGICAL_MIN8(0), \
+    HID_LOGICAL_MAX8(1), \
+    HID_REPORT_SIZE(1), \
+    HID_REPORT_COUNT(count_), \
+    /* Data, Variable, Absolute */ \
+    HID_INPUT(0x02), \
+    HID_REPORT_SIZE(8 - (count_)), \
+    HID_REPORT_COUNT(1), \
+    /* Constant */ \
+    HID_INPUT(0x01),
+
+#define HID_FIELD_DESC_REL8(usage_) \
+    HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP), \
+    HID_USAGE(usage_), \
+    HID_LOGICAL_MIN8(-127), \
+    HID_LOGICAL_MAX8(127), \
+    HID_REPORT_SIZE(8), \
+    HID_REPORT_COUNT(1), \
+    /* Data, Variable, Relative */ \
+    HID_INPUT(0x06),
+
+#define HID_FIELD_DESC_VENDOR(usage_, type_) \
+    HID_USAGE_PAGE_VENDOR(0xff00), \
+    HID_USAGE(usage_), \
+    HID_LOGICAL_MIN8(0), \
+    HID_LOGICAL_MAX16(0xff, 0x00), \
+    HID_REPORT_SIZE(8), \
+    HID_REPORT_COUNT(sizeof(type_)), \
+    /* Data, Variable, Absolute */ \
+    HID_FEATURE(0x02),
+
+#define HID_INPUT_DESC(NAME_, name_, id_, type_) HID_INPUT_DESC_##type_(NAME_, id_)
+#define HID_INPUT_DESC_INPUT(NAME_, id_) \
+    HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP), \
+    HID_USAGE(HID_USAGE_GEN_DESKTOP_MOUSE), \
+    HID_COLLECTION(HID_COLLECTION_APPLICATION), \
+        HID_REPORT_ID(id_), \
+        HID_USAGE(HID_USAGE_GEN_DESKTOP_POINTER), \
+        HID_COLLECTION(HID_COLLECTION_PHYSICAL), \
+            HID_##NAME_##_FIELDS(HID_FIELD_DESC) \
+        HID_END_COLLECTION, \
+    HID_END_COLLECTION,
+#define HID_INPUT_DESC_FEATURE(NAME_, id_)
+
+#define HID_FEATURE_DESC(NAME_, name_, id_, type_) HID_FEATURE_DESC_##type_(NAME_, id_)
+#define HID_FEATURE_DESC_INPUT(NAME_, id_)
+#define HID_FEATURE_DESC_FEATURE(NAME_, id_) \
+    HID_REPORT_ID(id_), \
+    HID_##NAME_##_FIELDS(HID_FIELD_DESC)
+
+const uint8_t hid_report_desc[] = {
+    HID_REPORTS(HID_INPUT_DESC)
+    HID_USAGE_PAGE_VENDOR(0xff00),
+    HID_USAGE(0x01),
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),
+        HID_REPORTS(HID_FEATURE_DESC)
+    HID_END_COLLECTION,
+};
+
+const size_t hid_report_desc_size = sizeof(hid_report_desc);
+
+/*
+ * Build-time checks that the structs in main.h match the descriptor above:
+ * the two are expanded from the same lists, but through separate per-kind
+ * macros, so a kind whose C type and report size disagree is caught here.
+ */
+
+#define HID_FIELD_BITS(kind_, name_, ...) + HID_FIELD_BITS_##kind_(__VA_ARGS__)
+#define HID_FIELD_BITS_BUTTONS(count_) 8
+#define HID_FIELD_BITS_REL8(usage_) 8
+#define HID_FIELD_BITS_VENDOR(usage_, type_) (8 * sizeof(type_))
+
+#define HID_FIELD_CHECK(kind_, name_, ...) HID_FIELD_CHECK_##kind_(name_, __VA_ARGS__)
+#define HID_FIELD_CHECK_BUTTONS(name_, count_) \
+    BUILD_ASSERT((count_) >= 1 && (count_) <= 7, \
+        #name_ ": only 1 to 7 buttons fit in a byte with padding");
+#define HID_FIELD_CHECK_REL8(name_, usage_)
+#define HID_FIELD_CHECK_VENDOR(name_, usage_, type_) \
+    BUILD_ASSERT(sizeof(type_) <= 0xff, \
+        #name_ ": too big for an 8-bit report count");
+
+#define HID_REPORT_CHECK(NAME_, name_, id_, type_) \
+    BUILD_ASSERT((id_) >= 1 && (id_) <= 0xff, #name_ ": bad report ID"); \
+    BUILD_ASSERT(8 * sizeof(struct hid_##name_##_report) == \
+        8 HID_##NAME_##_FIELDS(HID_FIELD_BITS), \
+        #name_ ": struct doesn't match the descriptor"); \
+    HID_##NAME_##_FIELDS(HID_FIELD_CHECK)
+
+HID_REPORTS(HID_REPORT_CHECK)
+
+#define HID_REPORT_ID_CASE(NAME_, name_, id_, type_) case id_:
+
+/* Never called: a report ID that's used twice is a duplicate case label */
+static inline void hid_report_ids_unique(int id)
+{
+    switch (id) {
+    HID_REPORTS(HID_REPORT_ID_CASE)
+        break;
+    }
+}
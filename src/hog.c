@@ -0,0 +1,486 @@
+#include "main.h"
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/logging/log.h>
+
+/*
+ * HID over GATT: the board is also a BLE mouse, a peripheral to the host at
+ * the same time as it's a central to the controller. It serves the same
+ * report descriptor as the USB interface, with the mouse as an input report
+ * and the motion parameter and counter reports as feature reports.
+ *
+ * Connection callbacks fire for both links, so everything here checks that
+ * it's looking at the one where we're the peripheral.
+ *
+ * Anything in range can connect, but a host can only pair while the window
+ * opened by hog_pairing_open() lasts, and the reports need an encrypted link,
+ * so only bonded hosts get the cursor. With no display or keys on the board
+ * every bond is Just Works, which leaves the motion parameters read-only
+ * over BLE: writing them needs an authenticated link.
+ */
+
+/* the host link carries every report, so ask for the shortest interval the
+ * spec allows (7.5 ms, in 1.25 ms units) and no peripheral latency */
+#define HOST_CONN_INTERVAL_MIN      6
+#define HOST_CONN_INTERVAL_MAX_MSEC 15
+#define HOST_CONN_LATENCY           0
+#define HOST_CONN_TIMEOUT_MSEC      2000
+
+#define HIDS_VERSION 0x0111
+
+enum hids_flags {
+    HIDS_REMOTE_WAKE = BIT(0),
+    HIDS_NORMALLY_CONNECTABLE = BIT(1),
+};
+
+enum hids_report_type {
+    HIDS_INPUT = 0x01,
+    HIDS_OUTPUT = 0x02,
+    HIDS_FEATURE = 0x03,
+};
+
+struct hids_info {
+    uint16_t version;
+    uint8_t code;
+    uint8_t flags;
+} __packed;
+
+struct hids_report {
+    uint8_t id;
+    uint8_t type;
+} __packed;
+
+
+static ssize_t read_info(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t read_report_map(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t read_report_ref(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t read_input_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t read_feature_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t write_feature_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, const void *buf, uint16_t len,
+    uint16_t offset, uint8_t flags);
+static ssize_t write_ctrl_point(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, const void *buf, uint16_t len,
+    uint16_t offset, uint8_t flags);
+static void on_input_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+static void on_connected(struct bt_conn *conn, uint8_t err);
+static void on_disconnected(struct bt_conn *conn, uint8_t reason);
+static void on_security_changed(struct bt_conn *conn, bt_security_t level,
+    enum bt_security_err err);
+static void on_recycled();
+static void set_host_conn_params(struct k_work *work);
+static void close_pairing(struct k_work *work);
+static enum bt_security_err on_pairing_accept(struct bt_conn *conn,
+    const struct bt_conn_pairing_feat *const feat);
+
+
+LOG_MODULE_REGISTER(hog, CONFIG_D2H_HOG_LOG_LEVEL);
+K_WORK_DEFINE(host_conn_params_work, set_host_conn_params);
+K_WORK_DELAYABLE_DEFINE(pairing_close_work, close_pairing);
+static K_SEM_DEFINE(notify_sem, 0, 1);
+
+static const struct hids_info info = {
+    .version = HIDS_VERSION,
+    .flags = HIDS_NORMALLY_CONNECTABLE,
+};
+
+static const struct hids_report input_ref = {
+    .id = HID_REPORT_ID_MOUSE,
+    .type = HIDS_INPUT,
+};
+
+static const struct hids_report params_ref = {
+    .id = HID_REPORT_ID_MOTION_PARAMS,
+    .type = HIDS_FEATURE,
+};
+
+static const struct hids_report counters_ref = {
+    .id = HID_REPORT_ID_COUNTERS,
+    .type = HIDS_FEATURE,
+};
+
+static const struct bt_data ad[] = {
+    BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE,
+        BT_BYTES_LIST_LE16(CONFIG_BT_DEVICE_APPEARANCE)),
+    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+    BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL),
+        BT_UUID_16_ENCODE(BT_UUID_BAS_VAL)),
+};
+
+static const struct bt_data sd[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME,
+        sizeof(CONFIG_BT_DEVICE_NAME) - 1),
+};
+
+BT_GATT_SERVICE_DEFINE(hog_svc,
+    BT_GATT_PRIMARY_SERVICE(BT_UUID_HIDS),
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_INFO, BT_GATT_CHRC_READ,
+        BT_GATT_PERM_READ, read_info, NULL, NULL),
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT_MAP, BT_GATT_CHRC_READ,
+        BT_GATT_PERM_READ, read_report_map, NULL, NULL),
+    /* attrs[6] and [7]: the input report value and its CCC */
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT,
+        BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ_ENCRYPT, read_input_report, NULL, NULL),
+    BT_GATT_CCC(on_input_ccc_changed,
+        BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT),
+    BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF, BT_GATT_PERM_READ,
+        read_report_ref, NULL, (void *)&input_ref),
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT,
+        BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+        BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_AUTHEN,
+        read_feature_report, write_feature_report, (void *)&params_ref),
+    BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF, BT_GATT_PERM_READ,
+        read_report_ref, NULL, (void *)&params_ref),
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT, BT_GATT_CHRC_READ,
+        BT_GATT_PERM_READ_ENCRYPT, read_feature_report, NULL,
+        (void *)&counters_ref),
+    BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF, BT_GATT_PERM_READ,
+        read_report_ref, NULL, (void *)&counters_ref),
+    BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_CTRL_POINT,
+        BT_GATT_CHRC_WRITE_WITHOUT_RESP, BT_GATT_PERM_WRITE,
+        NULL, write_ctrl_point, NULL),
+);
+
+#define HOG_INPUT_ATTR (&hog_svc.attrs[6])
+
+BT_CONN_CB_DEFINE(hog_conn_cbs) = {
+    .connected = on_connected,
+    .disconnected = on_disconnected,
+    .security_changed = on_security_changed,
+    .recycled = on_recycled,
+};
+
+static struct bt_conn *host_conn = NULL;
+static atomic_t notify_enabled = ATOMIC_INIT(0);
+static atomic_t host_suspended = ATOMIC_INIT(0);
+static struct k_poll_signal hog_signal = K_POLL_SIGNAL_INITIALIZER(hog_signal);
+static uint8_t last_input[sizeof(struct hid_mouse_report) - 1] = {};
+
+
+static bool is_host_conn(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+
+    return !bt_conn_get_info(conn, &info) &&
+        info.role == BT_CONN_ROLE_PERIPHERAL;
+}
+
+static void hog_changed()
+{
+    k_poll_signal_raise(&hog_signal, 0);
+}
+
+static void start_advertising()
+{
+    int err = bt_le_adv_start(BT_LE_ADV_CONN_FAST_1, ad, ARRAY_SIZE(ad),
+        sd, ARRAY_SIZE(sd));
+    if (err && err != -EALREADY) {
+        LOG_ERR("bt_le_adv_start: %d", err);
+        return;
+    }
+
+    LOG_INF("Advertising to hosts");
+}
+
+static ssize_t read_info(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &info, sizeof(info));
+}
+
+static ssize_t read_report_map(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, hid_report_desc,
+        hid_report_desc_size);
+}
+
+static ssize_t read_report_ref(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data,
+        sizeof(struct hids_report));
+}
+
+static ssize_t read_input_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, last_input,
+        sizeof(last_input));
+}
+
+/* Over GATT the report ID is in the Report Reference, so the value is the
+ * USB feature report without its first byte */
+static ssize_t read_feature_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    struct hids_report const *ref = attr->user_data;
+    uint8_t report[sizeof(union hid_feature_report) - 1];
+    int ret;
+
+    switch (ref->id) {
+    case HID_REPORT_ID_MOTION_PARAMS:
+        ret = params_get_report(report, sizeof(report));
+        break;
+    case HID_REPORT_ID_COUNTERS:
+        ret = counters_get_report(report, sizeof(report));
+        break;
+    default:
+        ret = -ENOTSUP;
+        break;
+    }
+
+    if (ret < 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, report, ret);
+}
+
+static ssize_t write_feature_report(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, const void *buf, uint16_t len,
+    uint16_t offset, uint8_t flags)
+{
+    /* only whole reports, which needs an ATT MTU bigger than the default
+     * 23; every current host negotiates one. The attribute's permissions
+     * already limit this to authenticated links. */
+    if (offset != 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    int err = params_set_report(buf, len);
+    if (err == -EMSGSIZE) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    } else if (err) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return len;
+}
+
+static ssize_t write_ctrl_point(struct bt_conn *conn,
+    const struct bt_gatt_attr *attr, const void *buf, uint16_t len,
+    uint16_t offset, uint8_t flags)
+{
+    if (offset != 0 || len != 1) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    /* 0: suspend, 1: exit suspend */
+    atomic_set(&host_suspended, ((uint8_t const *)buf)[0] == 0);
+    hog_changed();
+    return len;
+}
+
+static void on_input_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    atomic_set(&notify_enabled, value == BT_GATT_CCC_NOTIFY);
+    LOG_INF("Host %s input reports",
+        value == BT_GATT_CCC_NOTIFY ? "subscribed to" : "unsubscribed from");
+    hog_changed();
+}
+
+static void set_host_conn_params(struct k_work *work)
+{
+    static const struct bt_le_conn_param param = BT_LE_CONN_PARAM_INIT(
+        HOST_CONN_INTERVAL_MIN,
+        BT_GAP_MS_TO_CONN_INTERVAL(HOST_CONN_INTERVAL_MAX_MSEC),
+        HOST_CONN_LATENCY,
+        BT_GAP_MS_TO_CONN_TIMEOUT(HOST_CONN_TIMEOUT_MSEC)
+    );
+
+    /* this runs on the preemptible housekeeping queue, so the host can
+     * disconnect in the middle of it; hold a reference like hog_write() */
+    struct bt_conn *conn = host_conn ? bt_conn_ref(host_conn) : NULL;
+    if (!conn) {
+        return;
+    }
+
+    int err = bt_conn_le_param_update(conn, &param);
+    if (err) {
+        LOG_ERR("bt_conn_le_param_update: %d", err);
+    }
+    bt_conn_unref(conn);
+}
+
+static void on_connected(struct bt_conn *conn, uint8_t status)
+{
+    if (!is_host_conn(conn)) {
+        return;
+    }
+
+    if (status) {
+        LOG_WRN("Host connection failed: %u", status);
+        return;
+    }
+
+    char addr[BT_ADDR_LE_STR_LEN];
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+    LOG_INF("Host connected: %s", addr);
+
+    host_conn = bt_conn_ref(conn);
+    atomic_set(&host_suspended, 0);
+
+    int err = bt_conn_set_security(conn, BT_SECURITY_L2);
+    if (err) {
+        LOG_ERR("bt_conn_set_security: %d", err);
+    }
+}
+
+static void on_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    if (conn != host_conn) {
+        return;
+    }
+
+    LOG_INF("Host disconnected: %u", reason);
+
+    host_conn = NULL;
+    atomic_set(&notify_enabled, 0);
+    bt_conn_unref(conn);
+    k_sem_give(&notify_sem);
+    hog_changed();
+}
+
+static void on_security_changed(struct bt_conn *conn, bt_security_t level,
+    enum bt_security_err err)
+{
+    if (conn != host_conn) {
+        return;
+    }
+
+    if (err) {
+        /* an unbonded host outside the pairing window; it can't read
+         * reports, so don't let it sit on the connection either */
+        LOG_WRN("Host security failed: %d", err);
+        bt_conn_disconnect(conn, BT_HCI_ERR_AUTH_FAIL);
+        return;
+    }
+
+    k_work_submit_to_queue(&housekeeping_q, &host_conn_params_work);
+}
+
+static struct bt_conn_auth_cb auth_cbs = {
+    .pairing_accept = on_pairing_accept,
+};
+
+static atomic_t pairing_open = ATOMIC_INIT(0);
+
+static enum bt_security_err on_pairing_accept(struct bt_conn *conn,
+    const struct bt_conn_pairing_feat *const feat)
+{
+    if (is_host_conn(conn) && !atomic_get(&pairing_open)) {
+        LOG_WRN("Rejected pairing from a host outside the pairing window");
+        return BT_SECURITY_ERR_PAIR_NOT_ALLOWED;
+    }
+
+    return BT_SECURITY_ERR_SUCCESS;
+}
+
+static void close_pairing(struct k_work *work)
+{
+    atomic_set(&pairing_open, 0);
+    LOG_INF("Pairing window closed");
+}
+
+void hog_pairing_open()
+{
+    if (atomic_set(&pairing_open, 1)) {
+        return;
+    }
+
+    LOG_INF("Accepting new hosts for %d s", CONFIG_D2H_BLE_HID_PAIRING_SEC);
+    k_work_schedule_for_queue(&housekeeping_q, &pairing_close_work,
+        K_SECONDS(CONFIG_D2H_BLE_HID_PAIRING_SEC));
+}
+
+static void on_recycled()
+{
+    /* a connection object is free again, so advertising can resume */
+    if (!host_conn) {
+        start_advertising();
+    }
+}
+
+static void on_notify_sent(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&notify_sem);
+}
+
+static bool hog_is_ready()
+{
+    return host_conn && atomic_get(&notify_enabled) &&
+        !atomic_get(&host_suspended);
+}
+
+static int hog_write(uint8_t const *report, size_t len)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = HOG_INPUT_ATTR,
+        .data = &report[1],
+        .len = sizeof(last_input),
+        .func = on_notify_sent,
+    };
+
+    /* the mouse report is the only input report with a characteristic */
+    if (report[0] != HID_REPORT_ID_MOUSE || len != sizeof(struct hid_mouse_report)) {
+        return -ENOTSUP;
+    }
+
+    struct bt_conn *conn = host_conn ? bt_conn_ref(host_conn) : NULL;
+    if (!conn) {
+        return -ENOTCONN;
+    }
+
+    memcpy(last_input, &report[1], sizeof(last_input));
+    k_sem_reset(&notify_sem);
+
+    int err = bt_gatt_notify_cb(conn, &params);
+    bt_conn_unref(conn);
+    return err;
+}
+
+static int hog_wait_done(bool *stalled)
+{
+    *stalled = false;
+
+    for (;;) {
+        int err = k_sem_take(&notify_sem, K_MSEC(CONFIG_D2H_USB_EP_TIMEOUT_MSEC));
+        if (!host_conn) {
+            return -ECONNRESET;
+        }
+        if (!err) {
+            return 0;
+        }
+        *stalled = true;
+    }
+}
+
+const struct report_transport hog_transport = {
+    .name = "ble",
+    .signal = &hog_signal,
+    .is_ready = hog_is_ready,
+    .write = hog_write,
+    .wait_done = hog_wait_done,
+};
+
+void hog_bt_ready()
+{
+    int err = bt_conn_auth_cb_register(&auth_cbs);
+    if (err) {
+        LOG_ERR("bt_conn_auth_cb_register: %d", err);
+        return;
+    }
+
+    start_advertising();
+}
@@ -0,0 +1,24 @@
+#include "main.h"
+
+/*
+ * Work that isn't on the notification-to-report path (LED patterns,
+ * connection parameter updates, diagnostics) runs here instead of on the
+ * system workqueue, at a preemptible priority below every pipeline
+ * thread, so it can never delay a report.
+ */
+
+K_THREAD_STACK_DEFINE(housekeeping_stack, CONFIG_D2H_HOUSEKEEPING_STACK_SIZE);
+struct k_work_q housekeeping_q;
+
+int boot_housekeeping()
+{
+    struct k_work_queue_config cfg = {
+        .name = "housekeeping",
+    };
+
+    k_work_queue_start(&housekeeping_q, housekeeping_stack,
+        K_THREAD_STACK_SIZEOF(housekeeping_stack),
+        CONFIG_D2H_HOUSEKEEPING_THREAD_PRIORITY, &cfg);
+
+    return 0;
+}
@@ -2,78 +2,98 @@
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/logging/log.h>
 
+#define LED_TICK_MSEC 50
+
 struct led {
     struct gpio_dt_spec led;
-    struct k_work work;
-    struct k_timer timer;
-    int on_msec;
-    int off_msec;
+    atomic_t requested;
+    enum led_pattern active;
+    int64_t since;
+    bool lit;
+};
+
+struct led_pattern_def {
+    uint8_t on_ticks;
+    uint8_t off_ticks;
 };
 
 
+static void led_tick_handler(struct k_work *work);
+
+
 static struct led leds[LED_COUNT] = {
     [LED_BT_STATUS] = { .led = GPIO_DT_SPEC_GET(DT_ALIAS(bt_status_led), gpios) },
     [LED_USB_READY] = { .led = GPIO_DT_SPEC_GET(DT_ALIAS(usb_ready_led), gpios) },
     [LED_GYRO_ACTIVE] = { .led = GPIO_DT_SPEC_GET(DT_ALIAS(gyro_active_led), gpios) },
 };
 
-LOG_MODULE_REGISTER(leds, LOG_LEVEL_DBG);
+static const struct led_pattern_def patterns[LED_PATTERN_COUNT] = {
+    [LED_PATTERN_OFF] = { 0, 1 },
+    [LED_PATTERN_ON] = { 1, 0 },
+    [LED_PATTERN_BLINK_SLOW] = { 15, 5 },
+    [LED_PATTERN_BLINK_FAST] = { 3, 5 },
+    [LED_PATTERN_STROBE] = { 1, 1 },
+};
 
+LOG_MODULE_REGISTER(leds, CONFIG_D2H_LEDS_LOG_LEVEL);
+K_WORK_DELAYABLE_DEFINE(led_tick_work, led_tick_handler);
 
-void led_on(enum led_id id)
-{
-    leds[id].on_msec = 0;
-    k_timer_stop(&leds[id].timer);
-    k_work_cancel(&leds[id].work);
-    gpio_pin_set_dt(&leds[id].led, 1);
-}
 
-void led_off(enum led_id id)
+void led_set(enum led_id id, enum led_pattern pattern)
 {
-    leds[id].on_msec = 0;
-    k_timer_stop(&leds[id].timer);
-    k_work_cancel(&leds[id].work);
-    gpio_pin_set_dt(&leds[id].led, 0);
-}
+    /* called from the motion path on every packet, so asking for the
+     * pattern that's already requested must not cost anything */
+    if (atomic_get(&leds[id].requested) == pattern) {
+        return;
+    }
 
-void led_flash(int on_msec, int off_msec, enum led_id id)
-{
-    leds[id].on_msec = on_msec;
-    leds[id].off_msec = off_msec;
-    k_work_cancel(&leds[id].work);
-    gpio_pin_set_dt(&leds[id].led, 1);
-    k_timer_start(&leds[id].timer, K_MSEC(on_msec), K_NO_WAIT);
+    if (atomic_set(&leds[id].requested, pattern) != pattern) {
+        k_work_reschedule_for_queue(&housekeeping_q, &led_tick_work, K_NO_WAIT);
+    }
 }
 
-static void led_work_handler(struct k_work *work)
+static bool led_update(struct led *led, int64_t now)
 {
-    struct led *led = CONTAINER_OF(work, struct led, work);
-    if (!led->on_msec) {
-        return;
+    enum led_pattern pattern = atomic_get(&led->requested);
+
+    if (pattern != led->active) {
+        led->active = pattern;
+        led->since = now;
     }
 
-    int interval = gpio_pin_get_dt(&led->led)
-        ? led->off_msec
-        : led->on_msec;
+    struct led_pattern_def const *def = &patterns[pattern];
+    int64_t period = def->on_ticks + def->off_ticks;
+    int64_t tick = (now - led->since) / LED_TICK_MSEC;
+    bool lit = (tick % period) < def->on_ticks;
 
-    LOG_DBG("flash!");
+    if (lit != led->lit) {
+        led->lit = lit;
+        gpio_pin_set_dt(&led->led, lit);
+    }
 
-    gpio_pin_toggle_dt(&led->led);
-    k_timer_start(&led->timer, K_MSEC(interval), K_NO_WAIT);
+    return def->on_ticks && def->off_ticks;
 }
 
-static void led_timer_handler(struct k_timer *timer)
+static void led_tick_handler(struct k_work *work)
 {
-    struct led *led = CONTAINER_OF(timer, struct led, timer);
-    k_work_submit(&led->work);
+    int64_t now = k_uptime_get();
+    bool animating = false;
+
+    for (size_t i = 0; i < LED_COUNT; ++i) {
+        animating |= led_update(&leds[i], now);
+    }
+
+    if (animating) {
+        k_work_schedule_for_queue(&housekeeping_q, &led_tick_work,
+            K_MSEC(LED_TICK_MSEC));
+    }
 }
 
 static int led_init(struct led *led)
 {
-    k_work_init(&led->work, led_work_handler);
-    k_timer_init(&led->timer, led_timer_handler, NULL);
-    led->on_msec = 0;
-    led->off_msec = 0;
+    atomic_set(&led->requested, LED_PATTERN_OFF);
+    led->active = LED_PATTERN_OFF;
+    led->lit = false;
 
     if (!gpio_is_ready_dt(&led->led)) {
         LOG_ERR("GPIO device not ready");
@@ -96,12 +116,3 @@ int boot_leds()
 
     return err;
 }
-
-// static int led_thread_fn(void *_unused0, void *_unused1, void *_unused2)
-// {
-
-// }
-
-// K_THREAD_DEFINE(led_thread, LED_THREAD_STACK_SIZE,
-//     led_thread_fn, NULL, NULL, NULL,
-//     LED_THREAD_PRIORITY, 0, 1);
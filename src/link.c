@@ -0,0 +1,413 @@
+#include "main.h"
+#include <stdlib.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+/*
+ * Link quality monitor.
+ *
+ * The decoder reports every packet, with how many went missing before it
+ * according to the sequence number, and when it arrived. Every
+ * CONFIG_D2H_LINK_INTERVAL_MSEC the housekeeping queue reads the RSSI, turns
+ * the window into a loss rate and a jitter figure, and moves at most one step
+ * along a ladder of PHY and connection parameter settings, from fastest to
+ * longest range. Stepping down takes CONFIG_D2H_LINK_DOWN_WINDOWS bad windows
+ * in a row; stepping back up takes CONFIG_D2H_LINK_UP_WINDOWS good ones and
+ * an RSSI margin, so the link doesn't flap at the edge of a threshold.
+ *
+ * A PHY the controller or the peer refuses is skipped for the rest of the
+ * connection.
+ *
+ * The idle connection preset has a long interval and peripheral latency, so
+ * notifications arrive in bursts, and measured against the controller's
+ * packet timestamps that looks like heavy jitter on a healthy link. While
+ * it's in use the monitor doesn't judge the link at all, and once it's
+ * dropped the jitter estimate is reseeded and the first windows, while the
+ * active parameters take effect, are skipped too.
+ */
+
+/* fewer packets than this in a window says nothing about the link */
+#define LINK_MIN_PKTS 8
+/* windows to wait after a switch before judging its effect */
+#define LINK_EFFECT_WINDOWS 2
+#define LINK_LEVEL_DEFAULT 1
+
+struct link_level {
+    enum link_phy phy;
+    bool robust;
+};
+
+struct link_window {
+    int8_t rssi;
+    uint32_t pkts;
+    uint32_t loss_pct;
+    uint32_t jitter_us;
+};
+
+
+static void link_monitor_handler(struct k_work *work);
+
+
+LOG_MODULE_REGISTER(link, CONFIG_D2H_LINK_LOG_LEVEL);
+K_WORK_DELAYABLE_DEFINE(link_monitor_work, link_monitor_handler);
+
+static const struct link_level levels[] = {
+    { LINK_PHY_2M, false },
+    { LINK_PHY_1M, false },
+    { LINK_PHY_1M, true },
+    { LINK_PHY_CODED, true },
+};
+
+static const uint8_t phy_masks[LINK_PHY_COUNT] = {
+    [LINK_PHY_2M] = BT_GAP_LE_PHY_2M,
+    [LINK_PHY_1M] = BT_GAP_LE_PHY_1M,
+    [LINK_PHY_CODED] = BT_GAP_LE_PHY_CODED,
+};
+
+static const char *phy_names[LINK_PHY_COUNT] = {
+    [LINK_PHY_2M] = "2M",
+    [LINK_PHY_1M] = "1M",
+    [LINK_PHY_CODED] = "coded",
+};
+
+/* written by the decoder thread */
+static atomic_t window_pkts = ATOMIC_INIT(0);
+static atomic_t window_lost = ATOMIC_INIT(0);
+static atomic_t reseed = ATOMIC_INIT(1);
+static atomic_t idle = ATOMIC_INIT(0);
+static uint32_t prev_rx_cycles = 0;
+static uint32_t jitter_us = 0;
+
+/* written from Bluetooth callbacks */
+static atomic_t restart = ATOMIC_INIT(0);
+static atomic_t scan_rssi = ATOMIC_INIT(0);
+static atomic_t current_phy = ATOMIC_INIT(LINK_PHY_1M);
+static atomic_t phy_unsupported = ATOMIC_INIT(0);
+
+/* owned by the housekeeping queue */
+static size_t level = LINK_LEVEL_DEFAULT;
+static uint8_t bad_windows = 0;
+static uint8_t good_windows = 0;
+static int8_t rssi_avg = 0;
+static bool rssi_valid = false;
+static int phy_requested = -1;
+static uint8_t phy_wait = 0;
+static uint8_t idle_wait = 0;
+static uint32_t switches = 0;
+static struct link_window last = {};
+
+static struct {
+    uint8_t wait;
+    size_t from;
+    struct link_window before;
+} effect = {};
+
+
+void link_pkt(struct daydream_pkt const *pkt, unsigned lost)
+{
+    atomic_inc(&window_pkts);
+    if (lost) {
+        atomic_add(&window_lost, lost);
+    }
+
+    /* RFC 3550 interarrival jitter: how far the spacing of arrivals strays
+     * from the spacing the controller stamped on them */
+    if (!atomic_clear(&reseed) && !lost && !atomic_get(&idle)) {
+        int32_t arrival_us = k_cyc_to_us_floor32(pkt->rx_cycles - prev_rx_cycles);
+        int32_t d = arrival_us - pkt->duration * 1000;
+        int32_t j = jitter_us;
+        jitter_us = j + (abs(d) - j) / 16;
+    }
+
+    prev_rx_cycles = pkt->rx_cycles;
+}
+
+void link_scan_rssi(int8_t rssi)
+{
+    atomic_set(&scan_rssi, rssi);
+}
+
+void link_phy_updated(uint8_t rx_phy)
+{
+    for (size_t i = 0; i < LINK_PHY_COUNT; ++i) {
+        if (phy_masks[i] == rx_phy) {
+            atomic_set(&current_phy, i);
+        }
+    }
+}
+
+void link_set_idle(bool is_idle)
+{
+    atomic_set(&idle, is_idle);
+    atomic_set(&reseed, 1);
+}
+
+void link_connected()
+{
+    atomic_set(&restart, 1);
+    atomic_set(&reseed, 1);
+    atomic_set(&idle, 0);
+    atomic_set(&current_phy, LINK_PHY_1M);
+    k_work_reschedule_for_queue(&housekeeping_q, &link_monitor_work,
+        K_MSEC(CONFIG_D2H_LINK_INTERVAL_MSEC));
+}
+
+void link_disconnected()
+{
+    k_work_cancel_delayable(&link_monitor_work);
+}
+
+static int read_rssi(struct bt_conn *conn, int8_t *rssi)
+{
+    struct bt_hci_cp_read_rssi *cp;
+    struct bt_hci_rp_read_rssi *rp;
+    struct net_buf *buf;
+    struct net_buf *rsp = NULL;
+    uint16_t handle;
+
+    int err = bt_hci_get_conn_handle(conn, &handle);
+    if (err) {
+        return err;
+    }
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    rp = (void *)rsp->data;
+    *rssi = rp->rssi;
+    net_buf_unref(rsp);
+    return 0;
+}
+
+static void apply_level(struct bt_conn *conn, size_t next,
+    struct link_window const *w)
+{
+    struct link_level const *to = &levels[next];
+
+    if (to->phy != levels[level].phy) {
+        struct bt_conn_le_phy_param param = {
+            .options = to->phy == LINK_PHY_CODED
+                ? BT_CONN_LE_PHY_OPT_CODED_S8
+                : BT_CONN_LE_PHY_OPT_NONE,
+            .pref_tx_phy = phy_masks[to->phy],
+            .pref_rx_phy = phy_masks[to->phy],
+        };
+
+        int err = bt_conn_le_phy_update(conn, &param);
+        if (err) {
+            LOG_WRN("bt_conn_le_phy_update(%s): %d", phy_names[to->phy], err);
+            atomic_set_bit(&phy_unsupported, to->phy);
+            return;
+        }
+
+        phy_requested = to->phy;
+        phy_wait = LINK_EFFECT_WINDOWS;
+    }
+
+    LOG_INF("%s%s -> %s%s (rssi %d dBm, loss %u%%, jitter %u us)",
+        phy_names[levels[level].phy], levels[level].robust ? " robust" : "",
+        phy_names[to->phy], to->robust ? " robust" : "",
+        w->rssi, w->loss_pct, w->jitter_us);
+
+    effect.wait = LINK_EFFECT_WINDOWS;
+    effect.from = level;
+    effect.before = *w;
+
+    level = next;
+    switches += 1;
+    bad_windows = 0;
+    good_windows = 0;
+    COUNTER_INC(link_switch);
+    bluetooth_set_link_robust(to->robust);
+}
+
+/* The next usable level in direction dir, or level itself if there's none */
+static size_t next_level(int dir)
+{
+    for (int i = (int)level + dir; i >= 0 && i < (int)ARRAY_SIZE(levels); i += dir) {
+        if (!atomic_test_bit(&phy_unsupported, levels[i].phy)) {
+            return i;
+        }
+    }
+
+    return level;
+}
+
+/* Give up on a PHY change that the peer quietly declined, and go back to
+ * the level that matches the PHY we actually have */
+static void check_phy()
+{
+    enum link_phy phy = atomic_get(&current_phy);
+
+    if (phy_requested < 0 || phy_wait == 0 || --phy_wait > 0) {
+        return;
+    }
+
+    if (phy != (enum link_phy)phy_requested) {
+        LOG_WRN("%s PHY refused, staying on %s", phy_names[phy_requested],
+            phy_names[phy]);
+        atomic_set_bit(&phy_unsupported, phy_requested);
+
+        for (size_t i = 0; i < ARRAY_SIZE(levels); ++i) {
+            if (levels[i].phy == phy &&
+                levels[i].robust == levels[level].robust) {
+                level = i;
+                break;
+            }
+        }
+        effect.wait = 0;
+    }
+
+    phy_requested = -1;
+}
+
+static void check_effect(struct link_window const *w)
+{
+    if (effect.wait == 0 || --effect.wait > 0) {
+        return;
+    }
+
+    struct link_window const *b = &effect.before;
+    LOG_INF("after %s%s -> %s%s: rssi %d -> %d dBm, loss %u -> %u%%, "
+        "jitter %u -> %u us",
+        phy_names[levels[effect.from].phy],
+        levels[effect.from].robust ? " robust" : "",
+        phy_names[levels[level].phy], levels[level].robust ? " robust" : "",
+        b->rssi, w->rssi, b->loss_pct, w->loss_pct, b->jitter_us, w->jitter_us);
+}
+
+static void evaluate(struct bt_conn *conn, struct link_window const *w)
+{
+    bool bad = (rssi_valid && w->rssi < CONFIG_D2H_LINK_RSSI_LOW) ||
+        w->loss_pct > CONFIG_D2H_LINK_LOSS_HIGH_PCT ||
+        w->jitter_us > CONFIG_D2H_LINK_JITTER_HIGH_USEC;
+    bool good = (!rssi_valid || w->rssi >=
+            CONFIG_D2H_LINK_RSSI_LOW + CONFIG_D2H_LINK_RSSI_HYSTERESIS) &&
+        w->loss_pct <= CONFIG_D2H_LINK_LOSS_LOW_PCT &&
+        w->jitter_us <= CONFIG_D2H_LINK_JITTER_HIGH_USEC / 2;
+
+    bad_windows = bad ? MIN(bad_windows + 1, UINT8_MAX) : 0;
+    good_windows = good ? MIN(good_windows + 1, UINT8_MAX) : 0;
+
+    /* don't stack a second change on one that hasn't settled yet */
+    if (effect.wait || phy_wait) {
+        return;
+    }
+
+    size_t next = level;
+    if (bad_windows >= CONFIG_D2H_LINK_DOWN_WINDOWS) {
+        next = next_level(1);
+    } else if (good_windows >= CONFIG_D2H_LINK_UP_WINDOWS) {
+        next = next_level(-1);
+    }
+
+    if (next != level) {
+        apply_level(conn, next, w);
+    }
+}
+
+static void link_monitor_handler(struct k_work *work)
+{
+    struct bt_conn *conn = bluetooth_conn_ref();
+    if (!conn) {
+        return;
+    }
+
+    if (atomic_clear(&restart)) {
+        level = LINK_LEVEL_DEFAULT;
+        bad_windows = 0;
+        good_windows = 0;
+        phy_requested = -1;
+        phy_wait = 0;
+        idle_wait = 0;
+        effect.wait = 0;
+        rssi_avg = atomic_get(&scan_rssi);
+        rssi_valid = rssi_avg != 0;
+        atomic_clear(&phy_unsupported);
+        atomic_clear(&window_pkts);
+        atomic_clear(&window_lost);
+        bluetooth_set_link_robust(false);
+    }
+
+    struct link_window w = {
+        .pkts = atomic_clear(&window_pkts),
+    };
+    uint32_t lost = atomic_clear(&window_lost);
+
+    int8_t rssi;
+    int err = read_rssi(conn, &rssi);
+    if (!err) {
+        rssi_avg = rssi_valid ? (3 * rssi_avg + rssi) / 4 : rssi;
+        rssi_valid = true;
+    } else {
+        LOG_DBG("read_rssi: %d", err);
+    }
+
+    w.rssi = rssi_avg;
+    w.loss_pct = w.pkts + lost ? lost * 100 / (w.pkts + lost) : 0;
+    w.jitter_us = jitter_us;
+
+    check_phy();
+
+    if (atomic_get(&idle)) {
+        idle_wait = LINK_EFFECT_WINDOWS;
+        bad_windows = 0;
+        good_windows = 0;
+    } else if (idle_wait) {
+        idle_wait -= 1;
+    } else if (w.pkts + lost >= LINK_MIN_PKTS) {
+        check_effect(&w);
+        evaluate(conn, &w);
+    }
+
+    last = w;
+    COUNTER_SET(link_phy, levels[level].phy);
+    COUNTER_SET(link_rssi, (int32_t)w.rssi);
+    COUNTER_SET(link_loss_pct, w.loss_pct);
+    COUNTER_SET(link_jitter_us, w.jitter_us);
+
+    bt_conn_unref(conn);
+
+    k_work_schedule_for_queue(&housekeeping_q, &link_monitor_work,
+        K_MSEC(CONFIG_D2H_LINK_INTERVAL_MSEC));
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static int cmd_link(const struct shell *sh, size_t argc, char **argv)
+{
+    if (!bluetooth_is_connected()) {
+        shell_print(sh, "not connected");
+        return 0;
+    }
+
+    shell_print(sh, "phy %s%s, %u switches", phy_names[levels[level].phy],
+        levels[level].robust ? ", robust parameters" : "", switches);
+    shell_print(sh, "rssi %d dBm, loss %u%%, jitter %u us (%u packets)",
+        last.rssi, last.loss_pct, last.jitter_us, last.pkts);
+
+    for (size_t i = 0; i < LINK_PHY_COUNT; ++i) {
+        if (atomic_test_bit(&phy_unsupported, i)) {
+            shell_print(sh, "%s unsupported", phy_names[i]);
+        }
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), link, NULL, "Link quality and PHY", cmd_link, 1, 0);
+#endif
@@ -12,19 +12,38 @@
 #include <zephyr/sys/util.h>
 
 #include <zephyr/logging/log.h>
-LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
+LOG_MODULE_REGISTER(main, CONFIG_D2H_MAIN_LOG_LEVEL);
 
 int main(void)
 {
     int ret;
 
+    milestone_reached(MILESTONE_MAIN);
+
+    /* bt_enable() brings the controller up on the system workqueue, which
+     * would wait behind a cooperative main for all of boot; drop below it
+     * until boot is done so the two overlap */
+    k_thread_priority_set(k_current_get(), K_PRIO_PREEMPT(0));
+
+    ret = boot_counters();
+    if (ret < 0) {
+        return 0;
+    }
+
+    ret = boot_housekeeping();
+    if (ret < 0) {
+        return 0;
+    }
+
+    perf_register_main();
+
     ret = boot_leds();
     if (ret < 0) {  
         return 0;
     }
 
-    ret = boot_usb();
-    if (ret < 0) {  
+    ret = boot_params();
+    if (ret < 0) {
         return 0;
     }
 
@@ -33,22 +52,74 @@ int main(void)
         return 0;
     }
 
+    /* returns as soon as the controller is being brought up; scanning
+     * starts from its callback while USB is set up below */
     ret = boot_bluetooth();
     if (ret < 0) {  
         return 0;
     }
 
+    ret = boot_usb();
+    if (ret < 0) {  
+        return 0;
+    }
+
+    k_thread_priority_set(k_current_get(), CONFIG_MAIN_THREAD_PRIORITY);
+
+    /* the USB controller may DMA straight out of this */
+    UDC_STATIC_BUF_DEFINE(report_buf, sizeof(struct hid_mouse_report));
+    struct hid_mouse_report *report = (struct hid_mouse_report *)report_buf;
+
+    /* Every wait in here is bounded, so a host that stops polling, resets
+     * the bus, disconnects or goes to sleep can't wedge the writer. */
+    struct report_transport const *tp = NULL;
     while (true) {
-        UDC_STATIC_BUF_DEFINE(report, MOUSE_REPORT_COUNT);
+        bool stalled;
 
-        mouse_fetch_hid(report);
+        struct report_transport const *next = transport_select();
+        if (!next) {
+            next = transport_wait_ready(K_MSEC(CONFIG_D2H_USB_EP_TIMEOUT_MSEC));
+        }
+        if (next != tp) {
+            if (next) {
+                LOG_INF("Sending reports over %s", next->name);
+            }
+            /* anything queued while no host was listening is stale */
+            mouse_drop_pending();
+            tp = next;
+        }
+        if (!tp) {
+            continue;
+        }
 
-        ret = usb_write_hid(report);
+        ret = mouse_fetch_hid(report, K_MSEC(CONFIG_D2H_USB_EP_TIMEOUT_MSEC));
         if (ret) {
-            LOG_ERR("HID write error, %d", ret);
-        } else {
-            usb_wait_ep();
+            continue;
+        }
+
+        ret = transport_send(tp, report_buf, sizeof(*report), &stalled);
+        if (ret == -ECONNRESET || ret == -ENOTCONN) {
+            /* the host reset, suspended or went away; the next pass picks
+             * whichever transport is ready now */
+            mouse_drop_pending();
+            continue;
+        } else if (ret) {
+            static struct log_ratelimit write_rl = {};
+            COUNTER_INC(hid_write_err);
+            uint32_t n = log_ratelimit(&write_rl);
+            if (n) {
+                LOG_ERR("HID write error, %d (x%u)", ret, n);
+            }
+            continue;
         }
+
+        if (stalled) {
+            /* deliver the backlog as one report rather than replaying it */
+            mouse_merge_pending();
+        }
+
+        activity_report_delivered();
+        milestone_reached(MILESTONE_FIRST_REPORT);
     }
     return 0;
 }
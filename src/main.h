@@ -2,8 +2,20 @@
 
 #include <zephyr/kernel.h>
 #include <zephyr/usb/usbd.h>
+#include <zephyr/stats/stats.h>
 
 #define DAYDREAM_PKT_SIZE 20
+#define MOTION_PARAMS_VERSION 3
+#define COUNTERS_VERSION 2
+#define CURVE_LUT_SIZE 64
+#define CURVE_OUT_MAX (128 << 16)
+
+/* default filter parameters; here rather than in params.c so tests/ can
+ * check the filter as it ships */
+#define TRACKPAD_FILTER_CUTOFF_MHZ 1500
+#define TRACKPAD_FILTER_BETA 40
+#define GYRO_FILTER_CUTOFF_MHZ 1000
+#define GYRO_FILTER_BETA 8
 
 #define MINMAX(min_, x_, max_) MIN(max_, MAX(min_, x_))
 
@@ -14,12 +26,124 @@ enum scroll_direction {
     SCROLL_LOCK,
 };
 
-enum mouse_report_idx {
-    MOUSE_BTN_REPORT_IDX,
-    MOUSE_X_REPORT_IDX,
-    MOUSE_Y_REPORT_IDX,
-    MOUSE_WHEEL_REPORT_IDX,
-    MOUSE_REPORT_COUNT
+/*
+ * Every HID report, in one place: X(NAME, name, id, type), where type is
+ * INPUT or FEATURE. HID_<NAME>_FIELDS(F) lists what follows the report ID,
+ * as F(kind, name, args...):
+ *
+ *   BUTTONS(count)       1 to 7 buttons, a bit each, padded to a byte
+ *   REL8(usage)          a relative Generic Desktop axis, -127 to 127
+ *   VENDOR(usage, type)  a vendor-defined payload, sent as bytes
+ *
+ * The report IDs, the packed report structs and the report descriptor in
+ * hid_report.c are generated from these lists, and checked against each
+ * other at build time. The board overlay's in-report-size has to be the
+ * size of the largest input report.
+ */
+#define HID_REPORTS(X) \
+    X(MOUSE, mouse, 1, INPUT) \
+    X(MOTION_PARAMS, motion_params, 2, FEATURE) \
+    X(COUNTERS, counters, 3, FEATURE)
+
+#define HID_MOUSE_FIELDS(F) \
+    F(BUTTONS, buttons, 2) \
+    F(REL8, x, HID_USAGE_GEN_DESKTOP_X) \
+    F(REL8, y, HID_USAGE_GEN_DESKTOP_Y) \
+    F(REL8, wheel, HID_USAGE_GEN_DESKTOP_WHEEL)
+
+#define HID_MOTION_PARAMS_FIELDS(F) \
+    F(VENDOR, params, 0x01, struct motion_params)
+
+#define HID_COUNTERS_FIELDS(F) \
+    F(VENDOR, counters, 0x02, struct counters_report)
+
+#define HID_REPORT_ID_ENUM(NAME_, name_, id_, type_) \
+    HID_REPORT_ID_##NAME_ = id_,
+
+enum hid_report_id {
+    HID_REPORTS(HID_REPORT_ID_ENUM)
+};
+
+enum curve_type {
+    CURVE_CLASSIC,
+    CURVE_LINEAR,
+    CURVE_WINDOWS,
+    CURVE_SIGMOID,
+    CURVE_TYPE_COUNT
+};
+
+enum filter_axis {
+    FILTER_TRACKPAD_X,
+    FILTER_TRACKPAD_Y,
+    FILTER_GYRO_X,
+    FILTER_GYRO_Z,
+    FILTER_AXIS_COUNT
+};
+
+enum bias_axis {
+    BIAS_GYRO_X,
+    BIAS_GYRO_Y,
+    BIAS_GYRO_Z,
+    BIAS_ACCEL_X,
+    BIAS_ACCEL_Y,
+    BIAS_ACCEL_Z,
+    BIAS_AXIS_COUNT,
+    BIAS_GYRO_AXIS_COUNT = BIAS_ACCEL_X,
+};
+
+enum milestone {
+    MILESTONE_MAIN,
+    MILESTONE_USB_CONFIGURED,
+    MILESTONE_BT_READY,
+    MILESTONE_CONTROLLER_FOUND,
+    MILESTONE_SUBSCRIBED,
+    MILESTONE_FIRST_REPORT,
+    MILESTONE_COUNT
+};
+
+enum activity_state {
+    ACTIVITY_ACTIVE,
+    ACTIVITY_IDLE,
+    ACTIVITY_SUSPENDED,
+    ACTIVITY_STATE_COUNT
+};
+
+enum conn_preset {
+    CONN_PRESET_ACTIVE,
+    CONN_PRESET_IDLE,
+    CONN_PRESET_ROBUST,
+    CONN_PRESET_COUNT
+};
+
+enum led_pattern {
+    LED_PATTERN_OFF,
+    LED_PATTERN_ON,
+    LED_PATTERN_BLINK_SLOW,
+    LED_PATTERN_BLINK_FAST,
+    LED_PATTERN_STROBE,
+    LED_PATTERN_COUNT
+};
+
+enum perf_stage {
+    PERF_STAGE_DECODE,
+    PERF_STAGE_MOTION,
+    PERF_STAGE_REPORT,
+    PERF_STAGE_LATENCY,
+    PERF_STAGE_COUNT
+};
+
+enum perf_queue {
+    PERF_QUEUE_DAYDREAM,
+    PERF_QUEUE_MOUSE,
+    PERF_QUEUE_COUNT
+};
+
+/* in order of decreasing throughput and increasing range */
+enum link_phy {
+    LINK_PHY_2M,
+    LINK_PHY_1M,
+    LINK_PHY_CODED,
+    LINK_PHY_COUNT
 };
 
 enum led_id {
@@ -29,19 +153,22 @@ enum led_id {
     LED_COUNT
 };
 
+/* The IMU fields are 13-bit two's complement and the trackpad is 8 bits on the
+ * wire, so nothing here needs more than 16 */
 struct daydream_pkt {
-    int orient_x;
-    int orient_y;
-    int orient_z;
-    int accel_x;
-    int accel_y;
-    int accel_z;
-    int gyro_x;
-    int gyro_y;
-    int gyro_z;
-    int trackpad_x;
-    int trackpad_y;
-    int duration;
+    uint32_t rx_cycles;
+    int16_t orient_x;
+    int16_t orient_y;
+    int16_t orient_z;
+    int16_t accel_x;
+    int16_t accel_y;
+    int16_t accel_z;
+    int16_t gyro_x;
+    int16_t gyro_y;
+    int16_t gyro_z;
+    uint8_t trackpad_x;
+    uint8_t trackpad_y;
+    uint16_t duration;
     uint16_t sqn : 5;
     uint16_t vol_up : 1;
     uint16_t vol_dn : 1;
@@ -49,6 +176,165 @@ struct daydream_pkt {
     uint16_t home : 1;
     uint16_t trackpad_btn : 1;
 };
+BUILD_ASSERT(sizeof(struct daydream_pkt) == 28, "daydream_pkt grew");
+
+/* Packet decoder state: the last packet, and what the next one is measured
+ * against */
+struct packet_decoder {
+    struct daydream_pkt pkt;
+    unsigned prev_timestamp;
+    bool has_initial;
+};
+
+/* Tunable motion parameters. This is also the payload of the
+ * HID_REPORT_ID_MOTION_PARAMS feature report, little-endian. */
+struct motion_params {
+    uint8_t version;
+    uint8_t scroll_max;
+    uint16_t trackpad_acceleration;
+    uint16_t trackpad_velocity;
+    uint16_t trackpad_drag_divisor;
+    uint16_t gyro_acceleration;
+    uint16_t gyro_velocity;
+    uint16_t accel_mix_velocity;
+    uint16_t scroll_tap_msec;
+    uint16_t scroll_repeat_msec;
+    uint16_t scroll_step_msec;
+    uint8_t trackpad_curve;
+    uint8_t gyro_curve;
+    uint16_t trackpad_filter_cutoff_mhz;
+    uint16_t trackpad_filter_beta;
+    uint16_t gyro_filter_cutoff_mhz;
+    uint16_t gyro_filter_beta;
+} __packed;
+
+/* Health counters, registered with the stats subsystem as "d2h". The link
+ * entries are the current values rather than counts; the rest only go up. */
+#define D2H_COUNTERS(X) \
+    X(pkt_rx) \
+    X(pkt_bad_len) \
+    X(pkt_queue_overrun) \
+    X(pkt_timeout) \
+    X(sqn_gap) \
+    X(pkt_lost) \
+    X(report_merged) \
+    X(report_dropped) \
+    X(hid_write_err) \
+    X(ep_stall) \
+    X(usb_reset) \
+    X(connect) \
+    X(conn_fail) \
+    X(disconnect) \
+    X(link_interval) \
+    X(link_latency) \
+    X(link_timeout) \
+    X(link_preset) \
+    X(link_phy) \
+    X(link_rssi) \
+    X(link_loss_pct) \
+    X(link_jitter_us) \
+    X(link_switch)
+
+STATS_SECT_START(d2h_stats)
+D2H_COUNTERS(STATS_SECT_ENTRY32)
+STATS_SECT_END;
+
+#define COUNTERS_REPORT_FIELD(name_) uint32_t name_;
+
+/* Payload of the HID_REPORT_ID_COUNTERS feature report, little-endian */
+struct counters_report {
+    uint16_t version;
+    uint32_t uptime_sec;
+    D2H_COUNTERS(COUNTERS_REPORT_FIELD)
+} __packed;
+
+#define HID_FIELD_DECL(kind_, name_, ...) HID_FIELD_DECL_##kind_(name_, __VA_ARGS__)
+#define HID_FIELD_DECL_BUTTONS(name_, count_) uint8_t name_;
+#define HID_FIELD_DECL_REL8(name_, usage_) int8_t name_;
+#define HID_FIELD_DECL_VENDOR(name_, usage_, type_) type_ name_;
+
+/* struct hid_<name>_report: a whole report, ID first, as sent on the wire */
+#define HID_REPORT_STRUCT(NAME_, name_, id_, type_) \
+    struct hid_##name_##_report { \
+        uint8_t id; \
+        HID_##NAME_##_FIELDS(HID_FIELD_DECL) \
+    } __packed;
+
+HID_REPORTS(HID_REPORT_STRUCT)
+
+#define HID_INPUT_MEMBER(NAME_, name_, id_, type_) HID_INPUT_MEMBER_##type_(name_)
+#define HID_INPUT_MEMBER_INPUT(name_) struct hid_##name_##_report name_;
+#define HID_INPUT_MEMBER_FEATURE(name_)
+#define HID_FEATURE_MEMBER(NAME_, name_, id_, type_) HID_FEATURE_MEMBER_##type_(name_)
+#define HID_FEATURE_MEMBER_INPUT(name_)
+#define HID_FEATURE_MEMBER_FEATURE(name_) struct hid_##name_##_report name_;
+
+/* Sized for the largest report of each type; the interrupt endpoint is
+ * sizeof(union hid_input_report) */
+union hid_input_report {
+    HID_REPORTS(HID_INPUT_MEMBER)
+};
+
+union hid_feature_report {
+    HID_REPORTS(HID_FEATURE_MEMBER)
+};
+
+struct curve_lut {
+    uint8_t shift;
+    uint32_t gain[CURVE_LUT_SIZE];
+};
+
+/* motion_params plus everything derived from them */
+struct motion_profile {
+    struct motion_params params;
+    struct curve_lut trackpad;
+    struct curve_lut gyro;
+};
+
+struct euro_filter {
+    int32_t x_q8;
+    int32_t dx_q8;
+    int prev_raw;
+    bool init;
+};
+
+/* Somewhere to send reports: write() starts sending one, wait_done() waits
+ * for the host to take it, and signal is raised whenever is_ready() may have
+ * changed */
+struct report_transport {
+    char const *name;
+    struct k_poll_signal *signal;
+    bool (*is_ready)();
+    int (*write)(uint8_t const *report, size_t len);
+    int (*wait_done)(bool *stalled);
+};
+
+struct usb_stall_stats {
+    uint32_t count;
+    uint32_t total_msec;
+    uint32_t max_msec;
+};
+
+/* Gyro zero-rate offset, in raw counts */
+struct gyro_bias {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+};
+
+/* Running sums of one stillness window's samples */
+struct bias_window {
+    uint32_t n;
+    int32_t sum[BIAS_AXIS_COUNT];
+    int64_t sum_sq[BIAS_AXIS_COUNT];
+};
+
+struct filter_stats {
+    uint32_t samples;
+    uint64_t raw_variation;
+    uint64_t out_variation;
+    uint64_t lag;
+};
 
 struct scroll_state {
     enum scroll_direction direction;
@@ -64,34 +350,196 @@ struct button_state {
     int duration;
 };
 
+struct log_ratelimit {
+    int64_t next;
+    uint32_t count;
+};
+
+
+/* Count an event, and return how many have happened since the last time this
+ * returned non-zero, at most once per CONFIG_D2H_LOG_RATELIMIT_MSEC. */
+static inline uint32_t log_ratelimit(struct log_ratelimit *rl)
+{
+    int64_t now = k_uptime_get();
+
+    rl->count += 1;
+    if (now < rl->next) {
+        return 0;
+    }
+
+    uint32_t count = rl->count;
+    rl->count = 0;
+    rl->next = now + CONFIG_D2H_LOG_RATELIMIT_MSEC;
+    return count;
+}
+
+
+/* activity */
+bool activity_update(bool active);
+void activity_usb_suspended(bool suspended);
+void activity_reset();
+void activity_report_delivered();
+
+/* bias_window */
+void bias_window_add(struct bias_window *w,
+    int32_t const sample[BIAS_AXIS_COUNT]);
+uint32_t bias_window_variance(struct bias_window const *w, enum bias_axis axis);
+int32_t bias_window_mean_q8(struct bias_window const *w, enum bias_axis axis);
+bool bias_window_is_still(struct bias_window const *w,
+    uint32_t variance[BIAS_AXIS_COUNT]);
+void bias_window_correct(struct bias_window const *w, bool first,
+    int32_t bias_q8[BIAS_GYRO_AXIS_COUNT],
+    int32_t residual_q8[BIAS_GYRO_AXIS_COUNT]);
 
 /* buttons */
 void button_update(int pressed, int duration, struct button_state *state);
 
+/* counters */
+extern STATS_SECT_DECL(d2h_stats) d2h_stats;
+#define COUNTER_INC(name_) STATS_INC(d2h_stats, name_)
+#define COUNTER_ADD(name_, n_) STATS_INCN(d2h_stats, name_, n_)
+#define COUNTER_SET(name_, value_) (d2h_stats.name_ = (value_))
+int boot_counters();
+int counters_get_report(uint8_t *buf, size_t len);
+
+/* curve */
+void curve_build(struct curve_lut *lut, enum curve_type type, uint8_t shift,
+    uint16_t velocity, uint16_t acceleration, uint16_t in_max);
+int32_t curve_apply(struct curve_lut const *lut, int delta, int duration);
+uint32_t curve_recip(int duration);
+
 /* daydream */
+extern const k_tid_t daydream_decode_thread;
 int daydream_queue_pkt(uint8_t const *pkt, k_timeout_t timeout);
+uint32_t daydream_queue_used();
+uint32_t daydream_queue_size();
+
+/* filter */
+int filter_apply(struct euro_filter *f, enum filter_axis axis,
+    uint16_t min_cutoff_mhz, uint16_t beta, int x, int duration);
+void filter_reset(struct euro_filter *f);
+
+/* gyro_bias */
+#if defined(CONFIG_D2H_GYRO_BIAS)
+void gyro_bias_update(struct daydream_pkt const *pkt);
+struct gyro_bias gyro_bias_get();
+void gyro_bias_connected();
+void gyro_bias_disconnected();
+void gyro_bias_bt_ready();
+#else
+static inline void gyro_bias_update(struct daydream_pkt const *pkt) {}
+static inline struct gyro_bias gyro_bias_get() { return (struct gyro_bias){}; }
+static inline void gyro_bias_connected() {}
+static inline void gyro_bias_disconnected() {}
+static inline void gyro_bias_bt_ready() {}
+#endif
+
+/* hid_report */
+extern const uint8_t hid_report_desc[];
+extern const size_t hid_report_desc_size;
+
+/* hog */
+#if defined(CONFIG_D2H_BLE_HID)
+extern const struct report_transport hog_transport;
+void hog_bt_ready();
+void hog_pairing_open();
+#else
+static inline void hog_bt_ready() {}
+static inline void hog_pairing_open() {}
+#endif
+
+/* housekeeping */
+extern struct k_work_q housekeeping_q;
+int boot_housekeeping();
 
 /* leds */
 int boot_leds();
-void led_on(enum led_id id);
-void led_off(enum led_id id);
-void led_flash(int on_msec, int off_msec, enum led_id id);
+void led_set(enum led_id id, enum led_pattern pattern);
+static inline void led_on(enum led_id id) { led_set(id, LED_PATTERN_ON); }
+static inline void led_off(enum led_id id) { led_set(id, LED_PATTERN_OFF); }
+
+/* link */
+#if defined(CONFIG_D2H_LINK_MONITOR)
+void link_pkt(struct daydream_pkt const *pkt, unsigned lost);
+void link_scan_rssi(int8_t rssi);
+void link_phy_updated(uint8_t rx_phy);
+void link_set_idle(bool is_idle);
+void link_connected();
+void link_disconnected();
+#else
+static inline void link_pkt(struct daydream_pkt const *pkt, unsigned lost) {}
+static inline void link_scan_rssi(int8_t rssi) {}
+static inline void link_phy_updated(uint8_t rx_phy) {}
+static inline void link_set_idle(bool is_idle) {}
+static inline void link_connected() {}
+static inline void link_disconnected() {}
+#endif
+
+/* milestone */
+void milestone_reached(enum milestone milestone);
 
 /* mouse */
 int boot_mouse();
 void mouse_reset();
-int mouse_push_daydream(struct daydream_pkt const *pkt);
-int mouse_fetch_hid(uint8_t *buf);
+void mouse_push_daydream(struct daydream_pkt const *pkt);
+uint32_t mouse_flush();
+void mouse_build_profile(struct motion_profile *profile);
+int mouse_fetch_hid(struct hid_mouse_report *report, k_timeout_t timeout);
+void mouse_merge_pending();
+void mouse_drop_pending();
+uint32_t mouse_queue_used();
+uint32_t mouse_queue_size();
+
+/* packet */
+bool packet_decode(struct packet_decoder *dec, uint8_t const *pkt,
+    unsigned *lost);
+
+/* params */
+int boot_params();
+struct motion_profile const *params_get();
+int params_set(struct motion_params const *params);
+int params_get_report(uint8_t *buf, size_t len);
+int params_set_report(uint8_t const *buf, size_t len);
+
+/* perf */
+#if defined(CONFIG_D2H_PERF)
+void perf_stage_add(enum perf_stage stage, uint32_t start);
+void perf_queue_depth(enum perf_queue queue, uint32_t depth);
+void perf_batch(uint32_t pkts, uint32_t reports);
+void perf_register_main();
+static inline uint32_t perf_now() { return k_cycle_get_32(); }
+#else
+static inline void perf_stage_add(enum perf_stage stage, uint32_t start) {}
+static inline void perf_queue_depth(enum perf_queue queue, uint32_t depth) {}
+static inline void perf_batch(uint32_t pkts, uint32_t reports) {}
+static inline void perf_register_main() {}
+static inline uint32_t perf_now() { return 0; }
+#endif
+
+/* transport */
+struct report_transport const *transport_select();
+struct report_transport const *transport_wait_ready(k_timeout_t timeout);
+int transport_send(struct report_transport const *tp, uint8_t const *report,
+    size_t len, bool *stalled);
 
 /* usb_hid */
+extern const struct report_transport usb_transport;
 int boot_usb();
 void usb_rwup_if_suspended();
-int usb_write_hid(uint8_t *buf);
-int usb_wait_ep();
+bool usb_is_suspended();
+bool usb_is_ready();
+int usb_write_hid(uint8_t const *buf, size_t len);
+int usb_wait_ep(bool *stalled);
+struct usb_stall_stats const *usb_stall_stats();
 
 /* usbd */
 struct usbd_context *usbd_init_device(usbd_msg_cb_t msg_cb);
 
 /* bluetooth */
+struct bt_conn;
 int boot_bluetooth();
 int bluetooth_is_connected();
+struct bt_conn *bluetooth_conn_ref();
+void bluetooth_set_link_robust(bool robust);
+void bluetooth_refresh_conn_params();
+void bluetooth_set_conn_preset(enum conn_preset preset);
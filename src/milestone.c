@@ -0,0 +1,35 @@
+#include "main.h"
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(milestone, CONFIG_D2H_MAIN_LOG_LEVEL);
+
+static const char *milestone_names[MILESTONE_COUNT] = {
+    [MILESTONE_MAIN] = "main",
+    [MILESTONE_USB_CONFIGURED] = "USB configured",
+    [MILESTONE_BT_READY] = "BT ready",
+    [MILESTONE_CONTROLLER_FOUND] = "controller found",
+    [MILESTONE_SUBSCRIBED] = "subscribed",
+    [MILESTONE_FIRST_REPORT] = "first HID report",
+};
+
+static atomic_t reached = ATOMIC_INIT(0);
+static uint32_t reached_us[MILESTONE_COUNT] = {};
+
+
+void milestone_reached(enum milestone milestone)
+{
+    /* only the first time counts, later reconnects aren't boot time */
+    if (atomic_test_and_set_bit(&reached, milestone)) {
+        return;
+    }
+
+    reached_us[milestone] = k_ticks_to_us_floor32(k_uptime_ticks());
+    /* uptime starts with the kernel, so this leaves out the bootloader and
+     * anything else before it */
+    LOG_INF("%s at %u us since kernel start",
+        milestone_names[milestone], reached_us[milestone]);
+
+    if (atomic_get(&reached) == BIT_MASK(MILESTONE_COUNT)) {
+        LOG_INF("usable %u us after kernel start", reached_us[MILESTONE_FIRST_REPORT]);
+    }
+}
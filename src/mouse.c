@@ -1,5 +1,4 @@
 #include "main.h"
-#include <math.h>
 #include <zephyr/logging/log.h>
 
 
@@ -7,13 +6,14 @@
 #define GYRO_IN_MAX 4096
 #define TRACKPAD_IN_MAX 255
 
-#define TRACKPAD_ACCELERATION 150
-#define TRACKPAD_VELOCITY 2500
-#define TRACKPAD_DRAG_DIVISOR 20
+/* curve table resolution: entry i covers speed i << shift (Q8 counts/ms) */
+#define TRACKPAD_CURVE_SHIFT 5
+#define GYRO_CURVE_SHIFT 8
 
-#define GYRO_ACCELERATION 20
-#define GYRO_VELOCITY 500
-#define ACCEL_MIX_VELOCITY 10
+#define TRACKPAD_DRAG_RADIUS 100
+
+/* hold Home and both volume buttons this long to let a new BLE host pair */
+#define PAIRING_CHORD_MSEC 3000
 
 #define MOUSE_BTN_LEFT 0
 #define MOUSE_BTN_RIGHT 1
@@ -41,29 +41,49 @@ struct trackpad {
 };
 
 struct gyro {
-    int x;
-    int y;
     bool init;
 };
 
 
+static void filter_pkt(struct motion_params const *params,
+    struct daydream_pkt *pkt);
 static void mouse_worker_handler(struct k_work *work);
 static void mouse_timer_handler(struct k_timer *timer);
-static void move_by_trackpad(struct daydream_pkt const *pkt, int8_t *x, int8_t *y);
-static void move_by_gyro(struct daydream_pkt const *pkt, int8_t *x, int8_t *y);
-static int8_t scroll_velocity(int duration);
+static void move_by_trackpad(struct motion_profile const *profile,
+    struct daydream_pkt const *pkt, int8_t *x, int8_t *y);
+static void move_by_gyro(struct motion_profile const *profile,
+    struct daydream_pkt const *pkt, int8_t *x, int8_t *y);
+static int8_t scroll_velocity(struct motion_params const *params, int duration);
+static int report_queue(struct hid_mouse_report *hid_msg);
+static void batch_add(struct hid_mouse_report *hid_msg, uint32_t rx_cycles);
+static void batch_flush();
 
 
-LOG_MODULE_REGISTER(mouse, LOG_LEVEL_INF);
-K_MSGQ_DEFINE(mouse_hid_queue, MOUSE_REPORT_COUNT, 8, sizeof(void*));
+LOG_MODULE_REGISTER(mouse, CONFIG_D2H_MOUSE_LOG_LEVEL);
+K_MSGQ_DEFINE(mouse_hid_queue, sizeof(struct hid_mouse_report), 8, sizeof(void*));
 
 static struct button_state buttons[N_BUTTONS] = {};
 static struct trackpad trackpad = {};
 static struct gyro gyro = {};
+static struct euro_filter filters[FILTER_AXIS_COUNT] = {};
 
-int mouse_push_daydream(struct daydream_pkt const *pkt)
+/* the report built up from the decoder's current batch of packets */
+static struct hid_mouse_report batch_msg;
+static bool batch_pending = false;
+static uint32_t batch_rx_cycles = 0;
+static uint32_t batch_reports = 0;
+
+void mouse_push_daydream(struct daydream_pkt const *raw)
 {
-    int8_t hid_msg[MOUSE_REPORT_COUNT] = {};
+    struct hid_mouse_report hid_msg = { .id = HID_REPORT_ID_MOUSE };
+    struct motion_profile const *profile = params_get();
+    struct motion_params const *params = &profile->params;
+    struct daydream_pkt filtered = *raw;
+    struct daydream_pkt const *pkt = &filtered;
+    uint32_t stage_start = perf_now();
+
+    gyro_bias_update(raw);
+    filter_pkt(params, &filtered);
 
     button_update(pkt->trackpad_btn, pkt->duration, &buttons[BTN_TRACKPAD]);
     button_update(pkt->home, pkt->duration, &buttons[BTN_HOME]);
@@ -71,29 +91,51 @@ int mouse_push_daydream(struct daydream_pkt const *pkt)
     button_update(pkt->vol_dn, pkt->duration, &buttons[BTN_VDOWN]);
     button_update(pkt->vol_up, pkt->duration, &buttons[BTN_VUP]);
 
+    if (buttons[BTN_HOME].pressed && buttons[BTN_VUP].pressed &&
+        buttons[BTN_VDOWN].pressed &&
+        MIN(buttons[BTN_HOME].duration, MIN(buttons[BTN_VUP].duration,
+            buttons[BTN_VDOWN].duration)) >= PAIRING_CHORD_MSEC) {
+        hog_pairing_open();
+    }
 
     if (!buttons[BTN_HOME].pressed) {
         led_off(LED_GYRO_ACTIVE);
-        move_by_trackpad(pkt, &hid_msg[MOUSE_X_REPORT_IDX], &hid_msg[MOUSE_Y_REPORT_IDX]);
+        move_by_trackpad(profile, pkt, &hid_msg.x, &hid_msg.y);
     } else {
         led_on(LED_GYRO_ACTIVE);
-        move_by_gyro(pkt, &hid_msg[MOUSE_X_REPORT_IDX], &hid_msg[MOUSE_Y_REPORT_IDX]);
+        move_by_gyro(profile, pkt, &hid_msg.x, &hid_msg.y);
     }
 
+    perf_stage_add(PERF_STAGE_MOTION, stage_start);
+    stage_start = perf_now();
+
     if (buttons[BTN_VDOWN].pressed && !buttons[BTN_VUP].pressed) {
-        hid_msg[MOUSE_WHEEL_REPORT_IDX] = -scroll_velocity(buttons[BTN_VDOWN].duration);
+        hid_msg.wheel = -scroll_velocity(params, buttons[BTN_VDOWN].duration);
     } else if (buttons[BTN_VUP].pressed && !buttons[BTN_VDOWN].pressed) {
-        hid_msg[MOUSE_WHEEL_REPORT_IDX] = scroll_velocity(buttons[BTN_VUP].duration);
+        hid_msg.wheel = scroll_velocity(params, buttons[BTN_VUP].duration);
     }
 
-    WRITE_BIT(hid_msg[MOUSE_BTN_REPORT_IDX], MOUSE_BTN_LEFT, pkt->trackpad_btn);
-    WRITE_BIT(hid_msg[MOUSE_BTN_REPORT_IDX], MOUSE_BTN_RIGHT, pkt->app);
+    WRITE_BIT(hid_msg.buttons, MOUSE_BTN_LEFT, pkt->trackpad_btn);
+    WRITE_BIT(hid_msg.buttons, MOUSE_BTN_RIGHT, pkt->app);
 
-    int err = k_msgq_put(&mouse_hid_queue, hid_msg, K_MSEC(5));
-    if (err) {
-        LOG_ERR("k_msgq_put: %d", err);
+    bool active = buttons[BTN_HOME].pressed ||
+        hid_msg.buttons || hid_msg.x || hid_msg.y || hid_msg.wheel;
+
+    /* idle or the host is asleep, so there's nothing worth sending */
+    if (activity_update(active)) {
+        batch_add(&hid_msg, pkt->rx_cycles);
     }
-    return err;
+
+    perf_stage_add(PERF_STAGE_REPORT, stage_start);
+}
+
+uint32_t mouse_flush()
+{
+    batch_flush();
+
+    uint32_t reports = batch_reports;
+    batch_reports = 0;
+    return reports;
 }
 
 void mouse_reset()
@@ -101,16 +143,55 @@ void mouse_reset()
     memset(buttons, 0, sizeof(buttons));
     trackpad.init = 0;
     gyro.init = 0;
+    for (size_t i = 0; i < FILTER_AXIS_COUNT; ++i) {
+        filter_reset(&filters[i]);
+    }
+    batch_pending = false;
     k_msgq_purge(&mouse_hid_queue);
+    activity_reset();
+}
+
+static void filter_pkt(struct motion_params const *params,
+    struct daydream_pkt *pkt)
+{
+    if (pkt->trackpad_x == 0 && pkt->trackpad_y == 0) {
+        /* finger lifted, the next touch starts from scratch */
+        filter_reset(&filters[FILTER_TRACKPAD_X]);
+        filter_reset(&filters[FILTER_TRACKPAD_Y]);
+    } else {
+        pkt->trackpad_x = filter_apply(&filters[FILTER_TRACKPAD_X],
+            FILTER_TRACKPAD_X, params->trackpad_filter_cutoff_mhz,
+            params->trackpad_filter_beta, pkt->trackpad_x, pkt->duration);
+        pkt->trackpad_y = filter_apply(&filters[FILTER_TRACKPAD_Y],
+            FILTER_TRACKPAD_Y, params->trackpad_filter_cutoff_mhz,
+            params->trackpad_filter_beta, pkt->trackpad_y, pkt->duration);
+    }
+
+    pkt->gyro_x = filter_apply(&filters[FILTER_GYRO_X], FILTER_GYRO_X,
+        params->gyro_filter_cutoff_mhz, params->gyro_filter_beta,
+        pkt->gyro_x, pkt->duration);
+    pkt->gyro_z = filter_apply(&filters[FILTER_GYRO_Z], FILTER_GYRO_Z,
+        params->gyro_filter_cutoff_mhz, params->gyro_filter_beta,
+        pkt->gyro_z, pkt->duration);
 }
 
-static int pythag(int x, int y)
+void mouse_build_profile(struct motion_profile *profile)
 {
-    return round(sqrt(x * x + y * y));
+    struct motion_params const *params = &profile->params;
+
+    curve_build(&profile->trackpad, params->trackpad_curve,
+        TRACKPAD_CURVE_SHIFT, params->trackpad_velocity,
+        params->trackpad_acceleration, TRACKPAD_IN_MAX);
+    curve_build(&profile->gyro, params->gyro_curve,
+        GYRO_CURVE_SHIFT, params->gyro_velocity,
+        params->gyro_acceleration, GYRO_IN_MAX);
 }
 
-static void move_by_trackpad(struct daydream_pkt const *pkt, int8_t *x, int8_t *y)
+static void move_by_trackpad(struct motion_profile const *profile,
+    struct daydream_pkt const *pkt, int8_t *x, int8_t *y)
 {
+    struct motion_params const *params = &profile->params;
+
     if (pkt->trackpad_x == 0 && pkt->trackpad_y == 0) {
         trackpad.init = false;
         return;
@@ -132,79 +213,67 @@ static void move_by_trackpad(struct daydream_pkt const *pkt, int8_t *x, int8_t *
 
     int cx = trackpad.x - 127;
     int cy = trackpad.y - 127;
-    if (pythag(cx, cy) >= 100 && pkt->trackpad_btn) {
-        *x = cx / TRACKPAD_DRAG_DIVISOR;
-        *y = cy / TRACKPAD_DRAG_DIVISOR;
+    if (pkt->trackpad_btn &&
+        cx * cx + cy * cy >= TRACKPAD_DRAG_RADIUS * TRACKPAD_DRAG_RADIUS) {
+        *x = cx / params->trackpad_drag_divisor;
+        *y = cy / params->trackpad_drag_divisor;
         return;
     }
 
-    int vx = delta_x * TRACKPAD_VELOCITY;
-    int vy = delta_y * TRACKPAD_VELOCITY;
-
-    int ax = delta_x * delta_x * TRACKPAD_ACCELERATION;
-    if (delta_x < 0) {
-        ax = -ax;
-    }
-
-    int ay = delta_y * delta_y * TRACKPAD_ACCELERATION;
-    if (delta_y < 0) {
-        ay = -ay;
-    }
-
-    int velocity_x = (vx + ax) / (pkt->duration * TRACKPAD_IN_MAX);
-    int velocity_y = (vy + ay) / (pkt->duration * TRACKPAD_IN_MAX);
+    int velocity_x = curve_apply(&profile->trackpad, delta_x, pkt->duration) / 65536;
+    int velocity_y = curve_apply(&profile->trackpad, delta_y, pkt->duration) / 65536;
 
     *x = MINMAX(INT8_MIN, velocity_x, INT8_MAX);
     *y = MINMAX(INT8_MIN, velocity_y, INT8_MAX);
-    LOG_DBG("track move t=%d x=%d y=%d", pkt->duration, (int)*x, (int)*y);
+    if (IS_ENABLED(CONFIG_D2H_LOG_HOT_PATH)) {
+        LOG_DBG("track move t=%d x=%d y=%d", pkt->duration, (int)*x, (int)*y);
+    }
 }
 
-static void move_by_gyro(struct daydream_pkt const *pkt, int8_t *x, int8_t *y)
+static void move_by_gyro(struct motion_profile const *profile,
+    struct daydream_pkt const *pkt, int8_t *x, int8_t *y)
 {
+    struct motion_params const *params = &profile->params;
+
     if (!gyro.init) {
         gyro.init = true;
-        gyro.x = 0;
-        gyro.y = 0;
         *x = *y = 0;
         return;
     }
 
-    int delta_x = pkt->gyro_z - gyro.x;
-    int delta_y = pkt->gyro_x - gyro.y;
-
-    int vx = delta_x * GYRO_VELOCITY;
-    int vy = delta_y * GYRO_VELOCITY;
-
-    int ax = delta_x * delta_x * GYRO_ACCELERATION;
-    if (delta_x < 0) {
-        ax = -ax;
-    }
-
-    int ay = delta_y * delta_y * GYRO_ACCELERATION;
-    if (delta_y < 0) {
-        ay = -ay;
-    }
+    /* a controller at rest still reads its zero-rate offset, which would
+     * otherwise turn into a steady drift */
+    struct gyro_bias bias = gyro_bias_get();
+    int delta_x = pkt->gyro_z - bias.z;
+    int delta_y = pkt->gyro_x - bias.x;
 
-    /* mix in a bit of the accelerometer. this feels a bit more natural to me */
-    int accel_x = pkt->accel_x * ACCEL_MIX_VELOCITY / ACCEL_IN_MAX;
-    int accel_y = pkt->accel_z * ACCEL_MIX_VELOCITY / ACCEL_IN_MAX;
+    /* mix in a bit of the accelerometer. this feels a bit more natural to me.
+     * accel_mix_velocity comes from the host and can be anything up to
+     * UINT16_MAX, which times a Q16 reciprocal doesn't fit in 32 bits */
+    uint32_t recip = curve_recip(pkt->duration);
+    int accel_x = pkt->accel_x * params->accel_mix_velocity / ACCEL_IN_MAX;
+    int accel_y = pkt->accel_z * params->accel_mix_velocity / ACCEL_IN_MAX;
+    int32_t mix_x = (int32_t)((int64_t)accel_x * recip / GYRO_IN_MAX);
+    int32_t mix_y = (int32_t)((int64_t)accel_y * recip / GYRO_IN_MAX);
 
-    int velocity_x = (accel_x - (vx + ax)) / (pkt->duration * GYRO_IN_MAX);
-    int velocity_y = (accel_y - (vy + ay)) / (pkt->duration * GYRO_IN_MAX);
+    int velocity_x = (mix_x - curve_apply(&profile->gyro, delta_x, pkt->duration)) / 65536;
+    int velocity_y = (mix_y - curve_apply(&profile->gyro, delta_y, pkt->duration)) / 65536;
 
     *x = MINMAX(INT8_MIN, velocity_x, INT8_MAX);
     *y = MINMAX(INT8_MIN, velocity_y, INT8_MAX);
-    LOG_DBG("gyro move x=%d y=%d", (int)*x, (int)*y);
+    if (IS_ENABLED(CONFIG_D2H_LOG_HOT_PATH)) {
+        LOG_DBG("gyro move x=%d y=%d", (int)*x, (int)*y);
+    }
 }
 
-static int8_t scroll_velocity(int duration)
+static int8_t scroll_velocity(struct motion_params const *params, int duration)
 {
-    if (duration <= 70) {
+    if (duration <= params->scroll_tap_msec) {
         return 1;
-    } else if (duration >= 1500) {
-        return 5;
-    } else if (duration >= 700) {
-        return (duration - 500) / 200;
+    } else if (duration >= params->scroll_repeat_msec) {
+        int offset = params->scroll_repeat_msec - params->scroll_step_msec;
+        return MIN((duration - offset) / params->scroll_step_msec,
+            params->scroll_max);
     } else {
         return 0;
     }
@@ -215,7 +284,126 @@ int boot_mouse()
     return 0;
 }
 
-int mouse_fetch_hid(uint8_t *buf)
+/* Fold the movement of an older report into a newer one. The newer report's
+ * buttons win, so a click that lives entirely in the older one is lost. */
+static void report_merge(struct hid_mouse_report *into,
+    struct hid_mouse_report const *older)
+{
+    into->x = MINMAX(-127, into->x + older->x, 127);
+    into->y = MINMAX(-127, into->y + older->y, 127);
+    into->wheel = MINMAX(-127, into->wheel + older->wheel, 127);
+}
+
+static bool axis_fits(int8_t a, int8_t b)
+{
+    return a + b >= -127 && a + b <= 127;
+}
+
+/* Whether two reports can be sent as one without losing anything */
+static bool report_fits(struct hid_mouse_report const *a,
+    struct hid_mouse_report const *b)
+{
+    return a->buttons == b->buttons && axis_fits(a->x, b->x) &&
+        axis_fits(a->y, b->y) && axis_fits(a->wheel, b->wheel);
+}
+
+static void batch_add(struct hid_mouse_report *hid_msg, uint32_t rx_cycles)
+{
+    /* a button change gets a report of its own, or a quick click inside one
+     * batch would never reach the host */
+    if (batch_pending && !report_fits(hid_msg, &batch_msg)) {
+        batch_flush();
+    }
+
+    if (batch_pending) {
+        report_merge(hid_msg, &batch_msg);
+    } else {
+        batch_rx_cycles = rx_cycles;
+    }
+
+    batch_msg = *hid_msg;
+    batch_pending = true;
+}
+
+static void batch_flush()
+{
+    if (!batch_pending) {
+        return;
+    }
+    batch_pending = false;
+
+    int err = report_queue(&batch_msg);
+    if (err) {
+        COUNTER_INC(report_dropped);
+        static struct log_ratelimit put_rl = {};
+        uint32_t n = log_ratelimit(&put_rl);
+        if (n) {
+            LOG_ERR("report_queue: %d (x%u)", err, n);
+        }
+    } else {
+        batch_reports += 1;
+    }
+
+    perf_queue_depth(PERF_QUEUE_MOUSE, k_msgq_num_used_get(&mouse_hid_queue));
+    /* measured from the oldest packet in the batch */
+    perf_stage_add(PERF_STAGE_LATENCY, batch_rx_cycles);
+}
+
+/*
+ * Never blocks the decoder. If the writer has fallen behind and the queue is
+ * full, the oldest report is merged into this one instead, so movement is
+ * delayed rather than lost.
+ */
+static int report_queue(struct hid_mouse_report *hid_msg)
+{
+    struct hid_mouse_report oldest;
+    int err;
+
+    while ((err = k_msgq_put(&mouse_hid_queue, hid_msg, K_NO_WAIT)) == -ENOMSG) {
+        if (!k_msgq_get(&mouse_hid_queue, &oldest, K_NO_WAIT)) {
+            report_merge(hid_msg, &oldest);
+            COUNTER_INC(report_merged);
+        }
+    }
+
+    return err;
+}
+
+int mouse_fetch_hid(struct hid_mouse_report *report, k_timeout_t timeout)
+{
+    return k_msgq_get(&mouse_hid_queue, report, timeout);
+}
+
+void mouse_merge_pending()
+{
+    struct hid_mouse_report merged;
+    struct hid_mouse_report next;
+
+    if (k_msgq_num_used_get(&mouse_hid_queue) < 2 ||
+        k_msgq_get(&mouse_hid_queue, &merged, K_NO_WAIT)) {
+        return;
+    }
+
+    while (!k_msgq_get(&mouse_hid_queue, &next, K_NO_WAIT)) {
+        report_merge(&next, &merged);
+        merged = next;
+    }
+
+    report_queue(&merged);
+}
+
+void mouse_drop_pending()
+{
+    COUNTER_ADD(report_dropped, k_msgq_num_used_get(&mouse_hid_queue));
+    k_msgq_purge(&mouse_hid_queue);
+}
+
+uint32_t mouse_queue_used()
+{
+    return k_msgq_num_used_get(&mouse_hid_queue);
+}
+
+uint32_t mouse_queue_size()
 {
-    return k_msgq_get(&mouse_hid_queue, buf, K_FOREVER);
+    return mouse_hid_queue.max_msgs;
 }
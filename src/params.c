@@ -0,0 +1,206 @@
+#include "main.h"
+#include <string.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+
+#define PARAMS_SETTINGS_KEY "d2h/motion/params"
+
+#define TRACKPAD_ACCELERATION 150
+#define TRACKPAD_VELOCITY 2500
+#define TRACKPAD_DRAG_DIVISOR 20
+
+#define GYRO_ACCELERATION 20
+#define GYRO_VELOCITY 500
+#define ACCEL_MIX_VELOCITY 10
+
+#define SCROLL_TAP_MSEC 70
+#define SCROLL_REPEAT_MSEC 700
+#define SCROLL_STEP_MSEC 200
+#define SCROLL_MAX 5
+
+
+static void params_save_handler(struct k_work *work);
+static int params_settings_set(const char *name, size_t len,
+    settings_read_cb read_cb, void *cb_arg);
+
+
+LOG_MODULE_REGISTER(params, CONFIG_D2H_PARAMS_LOG_LEVEL);
+K_WORK_DEFINE(params_save_work, params_save_handler);
+K_MUTEX_DEFINE(params_write_lock);
+SETTINGS_STATIC_HANDLER_DEFINE(d2h_motion, "d2h/motion", NULL,
+    params_settings_set, NULL, NULL);
+
+static const struct motion_params defaults = {
+    .version = MOTION_PARAMS_VERSION,
+    .trackpad_acceleration = TRACKPAD_ACCELERATION,
+    .trackpad_velocity = TRACKPAD_VELOCITY,
+    .trackpad_drag_divisor = TRACKPAD_DRAG_DIVISOR,
+    .gyro_acceleration = GYRO_ACCELERATION,
+    .gyro_velocity = GYRO_VELOCITY,
+    .accel_mix_velocity = ACCEL_MIX_VELOCITY,
+    .scroll_tap_msec = SCROLL_TAP_MSEC,
+    .scroll_repeat_msec = SCROLL_REPEAT_MSEC,
+    .scroll_step_msec = SCROLL_STEP_MSEC,
+    .scroll_max = SCROLL_MAX,
+    .trackpad_curve = CURVE_CLASSIC,
+    .gyro_curve = CURVE_CLASSIC,
+    .trackpad_filter_cutoff_mhz = TRACKPAD_FILTER_CUTOFF_MHZ,
+    .trackpad_filter_beta = TRACKPAD_FILTER_BETA,
+    .gyro_filter_cutoff_mhz = GYRO_FILTER_CUTOFF_MHZ,
+    .gyro_filter_beta = GYRO_FILTER_BETA,
+};
+
+/*
+ * The motion path reads whichever slot `active` points to, without taking a
+ * lock. Writers fill in the other slot, rebuild its curve tables, and then
+ * swap the pointer.
+ *
+ * A slot is only rewritten two updates after it was published, and the
+ * decoder thread is cooperative, so no lower-priority writer can run while
+ * it is still in the middle of a packet with the old pointer.
+ */
+static struct motion_profile slots[2] = {};
+static atomic_ptr_t active = ATOMIC_PTR_INIT(&slots[0]);
+
+
+struct motion_profile const *params_get()
+{
+    return atomic_ptr_get(&active);
+}
+
+static int params_validate(struct motion_params const *params)
+{
+    if (params->version != MOTION_PARAMS_VERSION) {
+        return -EPROTO;
+    }
+
+    if (!params->trackpad_drag_divisor || !params->scroll_step_msec ||
+        params->scroll_repeat_msec < params->scroll_step_msec ||
+        params->trackpad_curve >= CURVE_TYPE_COUNT ||
+        params->gyro_curve >= CURVE_TYPE_COUNT) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int params_publish(struct motion_params const *params)
+{
+    int err = params_validate(params);
+    if (err) {
+        return err;
+    }
+
+    k_mutex_lock(&params_write_lock, K_FOREVER);
+
+    struct motion_profile *next = params_get() == &slots[0]
+        ? &slots[1]
+        : &slots[0];
+    next->params = *params;
+    mouse_build_profile(next);
+    atomic_ptr_set(&active, next);
+
+    k_mutex_unlock(&params_write_lock);
+    return 0;
+}
+
+int params_set(struct motion_params const *params)
+{
+    int err = params_publish(params);
+    if (err) {
+        LOG_WRN("Rejected motion parameters: %d", err);
+        return err;
+    }
+
+    /* flash writes are slow, keep them out of the caller's context */
+    k_work_submit_to_queue(&housekeeping_q, &params_save_work);
+    return 0;
+}
+
+int params_get_report(uint8_t *buf, size_t len)
+{
+    if (len < sizeof(struct motion_params)) {
+        return -ENOMEM;
+    }
+
+    memcpy(buf, &params_get()->params, sizeof(struct motion_params));
+    return sizeof(struct motion_params);
+}
+
+int params_set_report(uint8_t const *buf, size_t len)
+{
+    struct motion_params params;
+
+    if (len != sizeof(params)) {
+        return -EMSGSIZE;
+    }
+
+    memcpy(&params, buf, sizeof(params));
+    return params_set(&params);
+}
+
+static void params_save_handler(struct k_work *work)
+{
+    struct motion_params params;
+
+    k_mutex_lock(&params_write_lock, K_FOREVER);
+    params = params_get()->params;
+    k_mutex_unlock(&params_write_lock);
+
+    int err = settings_save_one(PARAMS_SETTINGS_KEY, &params, sizeof(params));
+    if (err) {
+        LOG_ERR("settings_save_one: %d", err);
+    }
+}
+
+static int params_settings_set(const char *name, size_t len,
+    settings_read_cb read_cb, void *cb_arg)
+{
+    struct motion_params params;
+
+    if (!settings_name_steq(name, "params", NULL)) {
+        return -ENOENT;
+    }
+
+    if (len != sizeof(params)) {
+        LOG_WRN("Ignoring stored motion parameters (%zu bytes)", len);
+        return 0;
+    }
+
+    int ret = read_cb(cb_arg, &params, sizeof(params));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = params_publish(&params);
+    if (ret) {
+        LOG_WRN("Ignoring stored motion parameters: %d", ret);
+        return 0;
+    }
+
+    LOG_INF("Loaded motion parameters");
+    return 0;
+}
+
+int boot_params()
+{
+    int err = params_publish(&defaults);
+    if (err) {
+        LOG_ERR("default motion parameters: %d", err);
+        return err;
+    }
+
+    err = settings_subsys_init();
+    if (err) {
+        LOG_ERR("settings_subsys_init: %d", err);
+        return err;
+    }
+
+    err = settings_load_subtree("d2h/motion");
+    if (err) {
+        LOG_ERR("settings_load_subtree: %d", err);
+    }
+
+    /* the defaults still work, so don't hold up boot over this */
+    return 0;
+}
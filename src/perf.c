@@ -0,0 +1,227 @@
+#include "main.h"
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#define PERF_STACK_UNKNOWN SIZE_MAX
+
+
+struct perf_stage_stats {
+    uint32_t count;
+    uint32_t last;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+};
+
+/* decoder wakeups, and what each one got done */
+struct perf_batch_stats {
+    uint32_t wakeups;
+    uint32_t pkts;
+    uint32_t reports;
+    uint32_t max_pkts;
+};
+
+struct perf_budget {
+    char const *name;
+    uint32_t max_cycles;
+};
+
+struct perf_queue_budget {
+    char const *name;
+    uint32_t max_depth;
+};
+
+
+static void perf_report_handler(struct k_work *work);
+static void perf_load_handler(struct k_work *work);
+
+
+LOG_MODULE_REGISTER(perf, CONFIG_D2H_PERF_LOG_LEVEL);
+K_WORK_DELAYABLE_DEFINE(perf_report_work, perf_report_handler);
+K_WORK_DELAYABLE_DEFINE(perf_load_work, perf_load_handler);
+
+static struct perf_stage_stats stages[PERF_STAGE_COUNT] = {};
+static atomic_t queue_peaks[PERF_QUEUE_COUNT] = {};
+static struct perf_batch_stats batches = {};
+static k_tid_t main_thread = NULL;
+static uint32_t strikes = 0;
+
+static const struct perf_budget budgets[PERF_STAGE_COUNT] = {
+    [PERF_STAGE_DECODE] = { "decode", CONFIG_D2H_PERF_BUDGET_DECODE_CYCLES },
+    [PERF_STAGE_MOTION] = { "motion", CONFIG_D2H_PERF_BUDGET_MOTION_CYCLES },
+    [PERF_STAGE_REPORT] = { "report", CONFIG_D2H_PERF_BUDGET_REPORT_CYCLES },
+    /* ends when the report is queued, not when USB or BLE takes it */
+    [PERF_STAGE_LATENCY] = { "notify-to-queue", CONFIG_D2H_PERF_BUDGET_LATENCY_CYCLES },
+};
+
+static const struct perf_queue_budget queue_budgets[PERF_QUEUE_COUNT] = {
+    [PERF_QUEUE_DAYDREAM] = { "daydream_pkt_queue", CONFIG_D2H_PERF_BUDGET_DAYDREAM_QUEUE_DEPTH },
+    [PERF_QUEUE_MOUSE] = { "mouse_hid_queue", CONFIG_D2H_PERF_BUDGET_MOUSE_QUEUE_DEPTH },
+};
+
+
+void perf_stage_add(enum perf_stage stage, uint32_t start)
+{
+    /* every stage is only ever timed from a single thread */
+    struct perf_stage_stats *stats = &stages[stage];
+    uint32_t cycles = k_cycle_get_32() - start;
+
+    stats->count += 1;
+    stats->last = cycles;
+    stats->total += cycles;
+    if (cycles < stats->min || stats->count == 1) {
+        stats->min = cycles;
+    }
+    if (cycles > stats->max) {
+        stats->max = cycles;
+    }
+}
+
+void perf_queue_depth(enum perf_queue queue, uint32_t depth)
+{
+    atomic_val_t peak;
+
+    do {
+        peak = atomic_get(&queue_peaks[queue]);
+        if (depth <= (uint32_t)peak) {
+            return;
+        }
+    } while (!atomic_cas(&queue_peaks[queue], peak, depth));
+}
+
+void perf_batch(uint32_t pkts, uint32_t reports)
+{
+    /* only ever called from the decoder thread */
+    batches.wakeups += 1;
+    batches.pkts += pkts;
+    batches.reports += reports;
+    batches.max_pkts = MAX(batches.max_pkts, pkts);
+}
+
+void perf_register_main()
+{
+    main_thread = k_current_get();
+    k_work_schedule_for_queue(&housekeeping_q, &perf_report_work,
+        K_MSEC(CONFIG_D2H_PERF_REPORT_INTERVAL_MSEC));
+
+    if (IS_ENABLED(CONFIG_D2H_PERF_LOAD)) {
+        LOG_WRN("Load generator enabled");
+        k_work_schedule_for_queue(&housekeeping_q, &perf_load_work, K_NO_WAIT);
+    }
+}
+
+static size_t stack_unused(k_tid_t thread)
+{
+    size_t unused;
+
+    if (!thread || k_thread_stack_space_get(thread, &unused)) {
+        return PERF_STACK_UNKNOWN;
+    }
+    return unused;
+}
+
+static bool check_stack(char const *name, k_tid_t thread)
+{
+    size_t unused = stack_unused(thread);
+
+    if (unused == PERF_STACK_UNKNOWN) {
+        return true;
+    }
+
+    LOG_INF("stack %s: %zu bytes unused", name, unused);
+
+    if (unused < CONFIG_D2H_PERF_BUDGET_STACK_MIN_UNUSED) {
+        LOG_ERR("stack budget exceeded: %s has %zu bytes unused (budget %d)",
+            name, unused, CONFIG_D2H_PERF_BUDGET_STACK_MIN_UNUSED);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Each report covers the interval since the previous one. The budgets are
+ * checked against the interval's average rather than its worst sample,
+ * since a single sample includes whatever interrupts and higher-priority
+ * threads ran in the middle of it, and a violation only panics once it has
+ * lasted CONFIG_D2H_PERF_BUDGET_STRIKES intervals in a row.
+ */
+static void perf_report_handler(struct k_work *work)
+{
+    struct perf_stage_stats interval[PERF_STAGE_COUNT];
+    struct perf_batch_stats interval_batches;
+    bool ok = true;
+
+    /* the stages are timed from cooperative threads, so with the scheduler
+     * locked none of them can be halfway through an update */
+    k_sched_lock();
+    memcpy(interval, stages, sizeof(interval));
+    memset(stages, 0, sizeof(stages));
+    interval_batches = batches;
+    batches = (struct perf_batch_stats){};
+    k_sched_unlock();
+
+    for (size_t i = 0; i < PERF_STAGE_COUNT; ++i) {
+        struct perf_stage_stats const *stats = &interval[i];
+        uint32_t avg = stats->count ? stats->total / stats->count : 0;
+
+        LOG_INF("%s: n=%u min=%u avg=%u max=%u spread=%u cycles",
+            budgets[i].name, stats->count, stats->min, avg, stats->max,
+            stats->max - stats->min);
+
+        if (budgets[i].max_cycles && avg > budgets[i].max_cycles) {
+            LOG_ERR("cycle budget exceeded: %s avg=%u (budget %u)",
+                budgets[i].name, avg, budgets[i].max_cycles);
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < PERF_QUEUE_COUNT; ++i) {
+        uint32_t peak = atomic_set(&queue_peaks[i], 0);
+
+        LOG_INF("%s: peak depth %u", queue_budgets[i].name, peak);
+
+        if (queue_budgets[i].max_depth && peak > queue_budgets[i].max_depth) {
+            LOG_ERR("queue budget exceeded: %s peak=%u (budget %u)",
+                queue_budgets[i].name, peak, queue_budgets[i].max_depth);
+            ok = false;
+        }
+    }
+
+    LOG_INF("decoder: %u packets in %u wakeups (max %u), %u reports",
+        interval_batches.pkts, interval_batches.wakeups,
+        interval_batches.max_pkts, interval_batches.reports);
+
+    ok &= check_stack("daydream_decode_thread", daydream_decode_thread);
+    ok &= check_stack("main", main_thread);
+
+    strikes = ok ? 0 : strikes + 1;
+    if (strikes >= CONFIG_D2H_PERF_BUDGET_STRIKES &&
+        IS_ENABLED(CONFIG_D2H_PERF_BUDGET_ENFORCE)) {
+        LOG_ERR("over budget for %u reports in a row", strikes);
+        k_panic();
+    }
+
+    k_work_schedule_for_queue(&housekeeping_q, &perf_report_work,
+        K_MSEC(CONFIG_D2H_PERF_REPORT_INTERVAL_MSEC));
+}
+
+/* deliberately keeps the LED, logging and BLE control paths busy, so the
+ * notify-to-queue latency can be measured under load */
+static void perf_load_handler(struct k_work *work)
+{
+    static bool started = false;
+
+    if (!started) {
+        started = true;
+        led_set(LED_USB_READY, LED_PATTERN_STROBE);
+    }
+
+    for (int i = 0; i < CONFIG_D2H_PERF_LOAD_LOG_LINES; ++i) {
+        LOG_INF("load %d", i);
+    }
+
+    bluetooth_refresh_conn_params();
+
+    k_work_schedule_for_queue(&housekeeping_q, &perf_load_work,
+        K_MSEC(CONFIG_D2H_PERF_LOAD_INTERVAL_MSEC));
+}
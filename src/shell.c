@@ -0,0 +1,155 @@
+#include "main.h"
+#include <stdlib.h>
+#include <zephyr/shell/shell.h>
+
+#define SHELL_MAX_THREADS 16
+#define SHELL_DEFAULT_WINDOW_MSEC 1000
+
+
+struct thread_sample {
+    k_tid_t thread;
+    uint64_t cycles;
+};
+
+struct sample_set {
+    struct thread_sample threads[SHELL_MAX_THREADS];
+    size_t count;
+};
+
+struct report_ctx {
+    const struct shell *sh;
+    struct sample_set const *before;
+    uint64_t window;
+};
+
+
+static struct sample_set samples = {};
+
+
+static void take_sample(const struct k_thread *cthread, void *user_data)
+{
+    struct k_thread *thread = (struct k_thread *)cthread;
+    struct sample_set *set = user_data;
+    k_thread_runtime_stats_t stats;
+
+    if (set->count >= SHELL_MAX_THREADS ||
+        k_thread_runtime_stats_get(thread, &stats)) {
+        return;
+    }
+
+    set->threads[set->count].thread = thread;
+    set->threads[set->count].cycles = stats.execution_cycles;
+    set->count += 1;
+}
+
+/* Threads that weren't sampled, because they started during the window or
+ * there were more than SHELL_MAX_THREADS of them, have no baseline. */
+static bool sampled_cycles(struct sample_set const *set, k_tid_t thread,
+    uint64_t *cycles)
+{
+    for (size_t i = 0; i < set->count; ++i) {
+        if (set->threads[i].thread == thread) {
+            *cycles = set->threads[i].cycles;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_thread(const struct k_thread *cthread, void *user_data)
+{
+    struct k_thread *thread = (struct k_thread *)cthread;
+    struct report_ctx *ctx = user_data;
+    k_thread_runtime_stats_t stats;
+    size_t unused = 0;
+    uint64_t before;
+    char cpu[8] = "n/a";
+    const char *name = k_thread_name_get(thread);
+
+    if (k_thread_runtime_stats_get(thread, &stats)) {
+        return;
+    }
+
+    if (sampled_cycles(ctx->before, thread, &before)) {
+        uint64_t busy = stats.execution_cycles - before;
+        unsigned permille = ctx->window
+            ? (unsigned)(busy * 1000 / ctx->window)
+            : 0;
+        snprintk(cpu, sizeof(cpu), "%u.%u%%", permille / 10, permille % 10);
+    }
+
+    if (k_thread_stack_space_get(thread, &unused)) {
+        shell_print(ctx->sh, "%-24s %4d %7s %11s",
+            name ? name : "?",
+            k_thread_priority_get(thread),
+            cpu, "n/a");
+        return;
+    }
+
+    shell_print(ctx->sh, "%-24s %4d %7s %5zu/%-5zu",
+        name ? name : "?",
+        k_thread_priority_get(thread),
+        cpu,
+        thread->stack_info.size - unused, thread->stack_info.size);
+}
+
+static int cmd_threads(const struct shell *sh, size_t argc, char **argv)
+{
+    k_thread_runtime_stats_t before_all, after_all;
+    int window_msec = SHELL_DEFAULT_WINDOW_MSEC;
+
+    if (argc > 1) {
+        window_msec = atoi(argv[1]);
+        if (window_msec <= 0) {
+            shell_error(sh, "invalid window: %s", argv[1]);
+            return -EINVAL;
+        }
+    }
+
+    /* sampling is just reading counters the scheduler already keeps, so
+     * the cost to the rest of the system is the shell thread sleeping */
+    samples.count = 0;
+    k_thread_runtime_stats_all_get(&before_all);
+    k_thread_foreach(take_sample, &samples);
+
+    k_msleep(window_msec);
+
+    k_thread_runtime_stats_all_get(&after_all);
+
+    struct report_ctx ctx = {
+        .sh = sh,
+        .before = &samples,
+        .window = after_all.execution_cycles - before_all.execution_cycles,
+    };
+
+    /* printing can block on the shell transport, which isn't allowed
+     * while the locked walk holds the thread list spinlock */
+    shell_print(sh, "%-24s %4s %7s %11s", "thread", "prio", "cpu", "stack");
+    k_thread_foreach_unlocked(print_thread, &ctx);
+
+    uint64_t idle = after_all.idle_cycles - before_all.idle_cycles;
+    unsigned permille = ctx.window ? (unsigned)(idle * 1000 / ctx.window) : 0;
+    shell_print(sh, "idle: %u.%u%% over %d ms", permille / 10, permille % 10,
+        window_msec);
+
+    return 0;
+}
+
+static int cmd_queues(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "daydream_pkt_queue: %u/%u",
+        daydream_queue_used(), daydream_queue_size());
+    shell_print(sh, "mouse_hid_queue: %u/%u",
+        mouse_queue_used(), mouse_queue_size());
+    return 0;
+}
+
+SHELL_SUBCMD_SET_CREATE(d2h_cmds, (d2h));
+SHELL_SUBCMD_ADD((d2h), threads, NULL,
+    "Per-thread CPU use and stack high-water marks\n"
+    "Usage: threads [window_msec]",
+    cmd_threads, 1, 1);
+SHELL_SUBCMD_ADD((d2h), queues, NULL, "Pipeline queue fill levels",
+    cmd_queues, 1, 0);
+
+SHELL_CMD_REGISTER(d2h, &d2h_cmds, "Daydream2HID diagnostics", NULL);
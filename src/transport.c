@@ -0,0 +1,115 @@
+#include "main.h"
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+/*
+ * Report transports, in order of preference: reports go to USB while a host
+ * has it configured and awake, and over BLE HID otherwise.
+ */
+
+struct transport_stats {
+    uint32_t reports;
+    uint32_t errors;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+
+static const struct report_transport *const transports[] = {
+    &usb_transport,
+#if defined(CONFIG_D2H_BLE_HID)
+    &hog_transport,
+#endif
+};
+
+/* owned by the main thread */
+static struct transport_stats stats[ARRAY_SIZE(transports)] = {};
+
+
+struct report_transport const *transport_select()
+{
+    for (size_t i = 0; i < ARRAY_SIZE(transports); ++i) {
+        if (transports[i]->is_ready()) {
+            return transports[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct report_transport const *transport_wait_ready(k_timeout_t timeout)
+{
+    struct k_poll_event events[ARRAY_SIZE(transports)];
+    struct report_transport const *tp;
+
+    for (size_t i = 0; i < ARRAY_SIZE(transports); ++i) {
+        k_poll_event_init(&events[i], K_POLL_TYPE_SIGNAL,
+            K_POLL_MODE_NOTIFY_ONLY, transports[i]->signal);
+    }
+
+    while (!(tp = transport_select())) {
+        int err = k_poll(events, ARRAY_SIZE(events), timeout);
+        for (size_t i = 0; i < ARRAY_SIZE(transports); ++i) {
+            k_poll_signal_reset(transports[i]->signal);
+            events[i].state = K_POLL_STATE_NOT_READY;
+        }
+        if (err) {
+            return NULL;
+        }
+    }
+
+    return tp;
+}
+
+int transport_send(struct report_transport const *tp, uint8_t const *report,
+    size_t len, bool *stalled)
+{
+    struct transport_stats *st = NULL;
+    for (size_t i = 0; i < ARRAY_SIZE(transports); ++i) {
+        if (transports[i] == tp) {
+            st = &stats[i];
+        }
+    }
+
+    uint32_t start = k_cycle_get_32();
+    int err = tp->write(report, len);
+    if (!err) {
+        err = tp->wait_done(stalled);
+    }
+
+    if (err) {
+        st->errors += 1;
+        return err;
+    }
+
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    st->reports += 1;
+    st->total_us += us;
+    st->max_us = MAX(st->max_us, us);
+    return 0;
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static int cmd_transport(const struct shell *sh, size_t argc, char **argv)
+{
+    struct report_transport const *active = transport_select();
+
+    shell_print(sh, "%-6s %8s %8s %10s %10s", "", "reports", "errors",
+        "avg us", "max us");
+
+    for (size_t i = 0; i < ARRAY_SIZE(transports); ++i) {
+        struct transport_stats const *st = &stats[i];
+        shell_print(sh, "%-6s %8u %8u %10u %10u%s", transports[i]->name,
+            st->reports, st->errors,
+            st->reports ? (uint32_t)(st->total_us / st->reports) : 0,
+            st->max_us, transports[i] == active ? " (active)" : "");
+    }
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), transport, NULL,
+    "Reports sent over each transport, and how long the host took to\n"
+    "take each one",
+    cmd_transport, 1, 0);
+#endif
@@ -3,17 +3,73 @@
 #include <zephyr/usb/usb_device.h>
 #include <zephyr/usb/usbd.h>
 #include <zephyr/usb/class/usb_hid.h>
+#if defined(CONFIG_D2H_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(usb_hid, CONFIG_D2H_USB_LOG_LEVEL);
 
-LOG_MODULE_REGISTER(usb_hid);
+#if defined(CONFIG_USB_DEVICE_STACK_NEXT)
+/* the interrupt IN endpoint is sized from the devicetree */
+BUILD_ASSERT(DT_PROP(DT_INST(0, zephyr_hid_device), in_report_size) ==
+    sizeof(union hid_input_report),
+    "in-report-size must be the size of the largest input report");
+#endif
 
-static const uint8_t hid_report_desc[] = HID_MOUSE_REPORT_DESC(2);
 static enum usb_dc_status_code usb_status;
+static atomic_t usb_configured = ATOMIC_INIT(0);
+/* set when the bus resets or is reconfigured under an in-flight report */
+static atomic_t usb_bus_reset = ATOMIC_INIT(0);
+/* set once remote wakeup has been asked for in this suspend */
+static atomic_t usb_wakeup_requested = ATOMIC_INIT(0);
+static struct k_poll_signal usb_event_signal =
+    K_POLL_SIGNAL_INITIALIZER(usb_event_signal);
+
+static struct usb_stall_stats stall_stats = {};
+
+#if defined(CONFIG_USB_DEVICE_STACK_NEXT)
+static struct usbd_context *usbd_ctx;
+#endif
 
 static K_SEM_DEFINE(ep_write_sem, 0, 1);
 
-static inline void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+static void usb_status_update(enum usb_dc_status_code status)
 {
     usb_status = status;
+    if (status != USB_DC_SUSPEND) {
+        atomic_clear(&usb_wakeup_requested);
+    }
+
+    switch (status) {
+    case USB_DC_CONFIGURED:
+        atomic_set(&usb_configured, 1);
+        atomic_set(&usb_bus_reset, 1);
+        milestone_reached(MILESTONE_USB_CONFIGURED);
+        break;
+    case USB_DC_RESET:
+    case USB_DC_DISCONNECTED:
+        COUNTER_INC(usb_reset);
+        atomic_set(&usb_configured, 0);
+        atomic_set(&usb_bus_reset, 1);
+        activity_usb_suspended(false);
+        break;
+    case USB_DC_SUSPEND:
+        activity_usb_suspended(true);
+        break;
+    case USB_DC_RESUME:
+        activity_usb_suspended(false);
+        break;
+    default:
+        break;
+    }
+
+    /* wake the report writer, whatever it is waiting on */
+    k_poll_signal_raise(&usb_event_signal, status);
+}
+
+static inline void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+{
+    usb_status_update(status);
 }
 
 static void int_in_ready_cb(const struct device *dev)
@@ -22,28 +78,129 @@ static void int_in_ready_cb(const struct device *dev)
     k_sem_give(&ep_write_sem);
 }
 
+static int get_report_cb(const struct device *dev,
+    struct usb_setup_packet *setup, int32_t *len, uint8_t **data)
+{
+    static uint8_t report[sizeof(union hid_feature_report)];
+    uint8_t type = setup->wValue >> 8;
+    uint8_t id = setup->wValue & 0xff;
+    int ret;
+
+    if (type != HID_REPORT_TYPE_FEATURE) {
+        return -ENOTSUP;
+    }
+
+    report[0] = id;
+
+    switch (id) {
+    case HID_REPORT_ID_MOTION_PARAMS:
+        ret = params_get_report(&report[1], sizeof(report) - 1);
+        break;
+    case HID_REPORT_ID_COUNTERS:
+        ret = counters_get_report(&report[1], sizeof(report) - 1);
+        break;
+    default:
+        ret = -ENOTSUP;
+        break;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    *data = report;
+    *len = 1 + ret;
+    return 0;
+}
+
+static int set_report_cb(const struct device *dev,
+    struct usb_setup_packet *setup, int32_t *len, uint8_t **data)
+{
+    uint8_t type = setup->wValue >> 8;
+    uint8_t id = setup->wValue & 0xff;
+
+    if (type != HID_REPORT_TYPE_FEATURE || *len < 1 || (*data)[0] != id) {
+        return -ENOTSUP;
+    }
+
+    switch (id) {
+    case HID_REPORT_ID_MOTION_PARAMS:
+        return params_set_report(&(*data)[1], *len - 1);
+    default:
+        return -ENOTSUP;
+    }
+}
+
 void usb_rwup_if_suspended()
 {
-    if (IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP)) {
-        if (usb_status == USB_DC_SUSPEND) {
-            usb_wakeup_request();
-            return;
+    if (!IS_ENABLED(CONFIG_D2H_USBD_REMOTE_WAKEUP) || !usb_is_suspended()) {
+        return;
+    }
+
+    /* called for every active packet; one request per suspend is enough,
+     * and if the host hasn't enabled remote wakeup, retrying won't help */
+    if (atomic_set(&usb_wakeup_requested, 1)) {
+        return;
+    }
+
+#if defined(CONFIG_USB_DEVICE_STACK_NEXT)
+    int err = usbd_wakeup_request(usbd_ctx);
+#else
+    int err = usb_wakeup_request();
+#endif
+    if (err) {
+        static struct log_ratelimit wakeup_rl = {};
+        uint32_t n = log_ratelimit(&wakeup_rl);
+        if (n) {
+            LOG_ERR("remote wakeup request: %d (x%u)", err, n);
         }
     }
 }
 
+bool usb_is_suspended()
+{
+    return usb_status == USB_DC_SUSPEND;
+}
+
 #if defined(CONFIG_USB_DEVICE_STACK_NEXT)
+static void usbd_msg_cb(struct usbd_context *const ctx, const struct usbd_msg *msg)
+{
+    LOG_DBG("USBD message: %s", usbd_msg_type_string(msg->type));
+
+    switch (msg->type) {
+    case USBD_MSG_SUSPEND:
+        usb_status_update(USB_DC_SUSPEND);
+        break;
+    case USBD_MSG_RESUME:
+        usb_status_update(USB_DC_RESUME);
+        break;
+    case USBD_MSG_RESET:
+        usb_status_update(USB_DC_RESET);
+        break;
+    case USBD_MSG_VBUS_REMOVED:
+        usb_status_update(USB_DC_DISCONNECTED);
+        break;
+    case USBD_MSG_CONFIGURATION:
+        usb_status_update(msg->status ? USB_DC_CONFIGURED : USB_DC_RESET);
+        break;
+    default:
+        break;
+    }
+}
+
 static int enable_usb_device_next()
 {
     struct usbd_context *sample_usbd;
     int err;
 
-    sample_usbd = usbd_init_device(NULL);
+    sample_usbd = usbd_init_device(usbd_msg_cb);
     if (sample_usbd == NULL) {
         LOG_ERR("Failed to initialize USB device");
         return -ENODEV;
     }
 
+    usbd_ctx = sample_usbd;
+
     err = usbd_enable(sample_usbd);
     if (err) {
         LOG_ERR("Failed to enable device support");
@@ -59,6 +216,8 @@ static int enable_usb_device_next()
 static const struct device *hid_dev;
 static const struct hid_ops ops = {
     .int_in_ready = int_in_ready_cb,
+    .get_report = get_report_cb,
+    .set_report = set_report_cb,
 };
 
 int boot_usb()
@@ -76,7 +235,7 @@ int boot_usb()
     }
 
     usb_hid_register_device(hid_dev,
-                hid_report_desc, sizeof(hid_report_desc),
+                hid_report_desc, hid_report_desc_size,
                 &ops);
 
     usb_hid_init(hid_dev);
@@ -97,12 +256,119 @@ int boot_usb()
     return ret;
 }
 
-int usb_wait_ep()
+bool usb_is_ready()
+{
+    return atomic_get(&usb_configured) && !usb_is_suspended();
+}
+
+/* Wait for the in-flight report to complete, or for the bus to reset or be
+ * reconfigured under it. Returns -EAGAIN on timeout and -EINTR for any other
+ * USB event. */
+static int wait_ep_or_reset(k_timeout_t timeout)
+{
+    struct k_poll_event events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE,
+            K_POLL_MODE_NOTIFY_ONLY, &ep_write_sem),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+            K_POLL_MODE_NOTIFY_ONLY, &usb_event_signal),
+    };
+
+    int err = k_poll(events, ARRAY_SIZE(events), timeout);
+    if (err) {
+        return err;
+    }
+
+    if (!k_sem_take(&ep_write_sem, K_NO_WAIT)) {
+        return 0;
+    }
+
+    k_poll_signal_reset(&usb_event_signal);
+    if (atomic_clear(&usb_bus_reset)) {
+        k_sem_reset(&ep_write_sem);
+        return -ECONNRESET;
+    }
+
+    return -EINTR;
+}
+
+/* Wait for the host to take the report that was just written. Returns
+ * -ECONNRESET if the bus reset under it, and -ENOTCONN if the bus suspended
+ * or lost its configuration, in which case the report is abandoned. */
+int usb_wait_ep(bool *stalled)
 {
-    return k_sem_take(&ep_write_sem, K_FOREVER);
+    int64_t stall_start = 0;
+    int err;
+
+    for (;;) {
+        err = wait_ep_or_reset(K_MSEC(CONFIG_D2H_USB_EP_TIMEOUT_MSEC));
+        if (err != -EINTR && err != -EAGAIN) {
+            break;
+        }
+
+        /* nobody polls a suspended or unconfigured bus, and that can last
+         * indefinitely; give up on the report so main can pick another
+         * transport */
+        if (!usb_is_ready()) {
+            err = -ENOTCONN;
+            break;
+        }
+        if (err == -EINTR) {
+            continue;
+        }
+
+        if (!stall_start) {
+            stall_start = k_uptime_get();
+            stall_stats.count += 1;
+            COUNTER_INC(ep_stall);
+            LOG_WRN("Host stopped polling the endpoint");
+        }
+    }
+
+    *stalled = stall_start != 0;
+    if (*stalled) {
+        uint32_t msec = k_uptime_get() - stall_start;
+        stall_stats.total_msec += msec;
+        stall_stats.max_msec = MAX(stall_stats.max_msec, msec);
+        LOG_WRN("Endpoint %s after %u ms",
+            err == -ECONNRESET ? "reset" : err ? "abandoned" : "recovered",
+            msec);
+    }
+
+    return err;
 }
 
-int usb_write_hid(uint8_t *buf)
+int usb_write_hid(uint8_t const *buf, size_t len)
 {
-    return hid_int_ep_write(hid_dev, buf, MOUSE_REPORT_COUNT, NULL);
+    /* a reset that happened before this report doesn't affect it, and
+     * neither does the completion of one abandoned on a suspended bus */
+    atomic_clear(&usb_bus_reset);
+    k_sem_reset(&ep_write_sem);
+    return hid_int_ep_write(hid_dev, buf, len, NULL);
 }
+
+const struct report_transport usb_transport = {
+    .name = "usb",
+    .signal = &usb_event_signal,
+    .is_ready = usb_is_ready,
+    .write = usb_write_hid,
+    .wait_done = usb_wait_ep,
+};
+
+struct usb_stall_stats const *usb_stall_stats()
+{
+    return &stall_stats;
+}
+
+#if defined(CONFIG_D2H_SHELL)
+static int cmd_usb(const struct shell *sh, size_t argc, char **argv)
+{
+    shell_print(sh, "configured: %d, suspended: %d",
+        (int)atomic_get(&usb_configured), usb_is_suspended());
+    shell_print(sh, "stalls: %u, total %u ms, longest %u ms",
+        stall_stats.count, stall_stats.total_msec, stall_stats.max_msec);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((d2h), usb, NULL, "USB state and endpoint stalls",
+    cmd_usb, 1, 0);
+#endif
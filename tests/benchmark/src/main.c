@@ -0,0 +1,118 @@
+#include "main.h"
+#include <zephyr/ztest.h>
+
+/*
+ * Times the stages of the input pipeline that don't need Bluetooth or USB:
+ * packet decoding, and the filter and curve work that makes up most of the
+ * motion stage. Each is run over a synthetic trace of packets, and the
+ * average cycles per packet is printed along with a perf-budget.conf line
+ * that allows twice that, then checked against the budget in use.
+ */
+
+#define BENCH_PKTS 1024
+#define BENCH_MARGIN 2
+
+/* as mouse_build_profile() builds the trackpad curve */
+#define BENCH_CURVE_SHIFT 5
+#define BENCH_IN_MAX 255
+#define BENCH_VELOCITY 2500
+#define BENCH_ACCELERATION 150
+
+static uint8_t trace[BENCH_PKTS][DAYDREAM_PKT_SIZE];
+static struct daydream_pkt decoded[BENCH_PKTS];
+static struct curve_lut lut;
+
+/* Packets 15 ms apart with consecutive sequence numbers, as the controller
+ * sends them, and noise in every sensor field */
+static void *benchmark_setup(void)
+{
+    uint32_t seed = 1;
+
+    for (int i = 0; i < BENCH_PKTS; ++i) {
+        for (int b = 0; b < DAYDREAM_PKT_SIZE; ++b) {
+            seed = seed * 1103515245 + 12345;
+            trace[i][b] = seed >> 16;
+        }
+
+        unsigned timestamp = (i * 15) % 512;
+        unsigned sqn = i % 32;
+        trace[i][0] = timestamp >> 1;
+        trace[i][1] = (timestamp & 1) << 7 | sqn << 2 | (trace[i][1] & 0x03);
+    }
+
+    curve_build(&lut, CURVE_CLASSIC, BENCH_CURVE_SHIFT, BENCH_VELOCITY,
+        BENCH_ACCELERATION, BENCH_IN_MAX);
+    return NULL;
+}
+
+static uint32_t report(char const *name, char const *budget_name,
+    uint32_t cycles, uint32_t pkts, uint32_t budget)
+{
+    uint32_t avg = cycles / pkts;
+
+    TC_PRINT("%s: %u cycles (%u ns) per packet\n", name, avg,
+        (uint32_t)k_cyc_to_ns_floor64(avg));
+    TC_PRINT("  CONFIG_D2H_PERF_BUDGET_%s_CYCLES=%u\n", budget_name,
+        MAX(avg * BENCH_MARGIN, 1));
+    if (budget) {
+        zassert_true(avg <= budget, "%s over budget: %u > %u", name, avg,
+            budget);
+    }
+    return avg;
+}
+
+ZTEST(benchmark, test_decode)
+{
+    struct packet_decoder dec = {};
+    unsigned lost;
+    uint32_t decodes = 0;
+
+    uint32_t start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_PKTS; ++i) {
+        decodes += packet_decode(&dec, trace[i], &lost);
+        decoded[i] = dec.pkt;
+    }
+    uint32_t cycles = k_cycle_get_32() - start;
+
+    /* the first packet only seeds the decoder */
+    zassert_equal(decodes, BENCH_PKTS - 1);
+    report("decode", "DECODE", cycles, BENCH_PKTS, CONFIG_D2H_PERF_BUDGET_DECODE_CYCLES);
+}
+
+ZTEST(benchmark, test_motion)
+{
+    struct euro_filter filters[FILTER_AXIS_COUNT] = {};
+    int32_t sink = 0;
+
+    /* filter every axis and run both curves, which is more than any one
+     * packet does */
+    uint32_t start = k_cycle_get_32();
+    for (int i = 1; i < BENCH_PKTS; ++i) {
+        struct daydream_pkt const *p = &decoded[i];
+        int duration = MAX(p->duration, 1);
+
+        int x = filter_apply(&filters[FILTER_TRACKPAD_X], FILTER_TRACKPAD_X,
+            TRACKPAD_FILTER_CUTOFF_MHZ, TRACKPAD_FILTER_BETA, p->trackpad_x,
+            duration);
+        int y = filter_apply(&filters[FILTER_TRACKPAD_Y], FILTER_TRACKPAD_Y,
+            TRACKPAD_FILTER_CUTOFF_MHZ, TRACKPAD_FILTER_BETA, p->trackpad_y,
+            duration);
+        int gx = filter_apply(&filters[FILTER_GYRO_X], FILTER_GYRO_X,
+            GYRO_FILTER_CUTOFF_MHZ, GYRO_FILTER_BETA, p->gyro_x, duration);
+        int gz = filter_apply(&filters[FILTER_GYRO_Z], FILTER_GYRO_Z,
+            GYRO_FILTER_CUTOFF_MHZ, GYRO_FILTER_BETA, p->gyro_z, duration);
+
+        sink += curve_apply(&lut, x - decoded[i - 1].trackpad_x, duration);
+        sink += curve_apply(&lut, y - decoded[i - 1].trackpad_y, duration);
+        sink += curve_apply(&lut, gx, duration);
+        sink += curve_apply(&lut, gz, duration);
+    }
+    uint32_t cycles = k_cycle_get_32() - start;
+
+    /* keeps the loop from being optimised away */
+    TC_PRINT("motion checksum %d\n", sink);
+    report("filter+curve", "MOTION", cycles, BENCH_PKTS - 1,
+        CONFIG_D2H_PERF_BUDGET_MOTION_CYCLES);
+}
+
+ZTEST_SUITE(benchmark, NULL, benchmark_setup, NULL, NULL, NULL);
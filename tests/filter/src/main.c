@@ -0,0 +1,129 @@
+#include "main.h"
+#include <stdlib.h>
+#include <zephyr/ztest.h>
+
+/*
+ * Runs the One Euro filter, with the default parameters, over synthetic
+ * traces: slow motion with sensor noise, where it should take out most of the
+ * jitter, and fast clean motion, where it shouldn't fall far behind.
+ */
+
+#define TRACE_PKTS 400
+#define TRACE_DURATION 15
+/* packets for the filter to settle before lag counts */
+#define TRACE_SETTLE 20
+
+struct trace_result {
+    uint32_t raw_variation;
+    uint32_t out_variation;
+    uint32_t max_lag;
+};
+
+struct axis_params {
+    enum filter_axis axis;
+    uint16_t cutoff_mhz;
+    uint16_t beta;
+};
+
+static const struct axis_params trackpad = {
+    FILTER_TRACKPAD_X, TRACKPAD_FILTER_CUTOFF_MHZ, TRACKPAD_FILTER_BETA,
+};
+
+static const struct axis_params gyro = {
+    FILTER_GYRO_X, GYRO_FILTER_CUTOFF_MHZ, GYRO_FILTER_BETA,
+};
+
+/* deterministic noise in [-amplitude, amplitude] */
+static int32_t noise(uint32_t *seed, int32_t amplitude)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (int32_t)((*seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+/* A ramp of speed_q8 / 256 counts per packet, plus noise */
+static struct trace_result run_trace(struct axis_params const *p,
+    int32_t speed_q8, int32_t amplitude)
+{
+    struct euro_filter f = {};
+    struct trace_result r = {};
+    uint32_t seed = 1;
+    int prev_raw = 0;
+    int prev_out = 0;
+
+    for (int i = 0; i < TRACE_PKTS; ++i) {
+        int truth = 20 + (speed_q8 * i) / 256;
+        int raw = truth + (amplitude ? noise(&seed, amplitude) : 0);
+        int out = filter_apply(&f, p->axis, p->cutoff_mhz, p->beta, raw,
+            TRACE_DURATION);
+
+        if (i > 0) {
+            r.raw_variation += abs(raw - prev_raw);
+            r.out_variation += abs(out - prev_out);
+        }
+        if (i >= TRACE_SETTLE) {
+            r.max_lag = MAX(r.max_lag, (uint32_t)abs(truth - out));
+        }
+        prev_raw = raw;
+        prev_out = out;
+    }
+
+    return r;
+}
+
+static void check_slow(struct axis_params const *p, int32_t amplitude)
+{
+    /* still, and half a count per packet */
+    for (int32_t speed_q8 = 0; speed_q8 <= 128; speed_q8 += 128) {
+        struct trace_result r = run_trace(p, speed_q8, amplitude);
+        TC_PRINT("axis %d, %d/256 per packet: variation %u raw, %u filtered\n",
+            p->axis, speed_q8, r.raw_variation, r.out_variation);
+        zassert_true(2 * r.out_variation < r.raw_variation,
+            "axis %d: jitter only down from %u to %u", p->axis,
+            r.raw_variation, r.out_variation);
+    }
+}
+
+static void check_fast(struct axis_params const *p, int32_t from, int32_t to)
+{
+    for (int32_t speed = from; speed <= to; speed *= 2) {
+        struct trace_result r = run_trace(p, speed * 256, 0);
+        TC_PRINT("axis %d, %d per packet: lag %u\n", p->axis, speed,
+            r.max_lag);
+        /* never more than a packet behind */
+        zassert_true(r.max_lag <= (uint32_t)speed, "axis %d: lag %u at %d",
+            p->axis, r.max_lag, speed);
+    }
+}
+
+ZTEST(filter, test_trackpad_slow_jitter)
+{
+    check_slow(&trackpad, 2);
+}
+
+ZTEST(filter, test_gyro_slow_jitter)
+{
+    check_slow(&gyro, 4);
+}
+
+ZTEST(filter, test_trackpad_fast_lag)
+{
+    check_fast(&trackpad, 4, 16);
+}
+
+ZTEST(filter, test_gyro_fast_lag)
+{
+    check_fast(&gyro, 40, 320);
+}
+
+ZTEST(filter, test_bypass)
+{
+    struct euro_filter f = {};
+
+    /* a cutoff of 0 turns the filter off */
+    for (int i = 0; i < 8; ++i) {
+        zassert_equal(filter_apply(&f, FILTER_TRACKPAD_X, 0, 0, i * 37,
+            TRACE_DURATION), i * 37);
+    }
+}
+
+ZTEST_SUITE(filter, NULL, NULL, NULL, NULL, NULL);
@@ -0,0 +1,145 @@
+#include "main.h"
+#include <stdlib.h>
+#include <zephyr/ztest.h>
+
+/*
+ * Feeds the gyro bias estimator synthetic windows: a controller lying still
+ * with a known bias and some sensor noise, one being waved around, and one
+ * turning slowly, and checks what's left of the bias after correcting for the
+ * estimate.
+ */
+
+#define GRAVITY 1000
+
+static const int32_t true_bias[BIAS_GYRO_AXIS_COUNT] = { 7, -3, 12 };
+
+/* deterministic noise in [-amplitude, amplitude] */
+static int32_t noise(uint32_t *seed, int32_t amplitude)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (int32_t)((*seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static void fill_still(struct bias_window *w, uint32_t *seed)
+{
+    *w = (struct bias_window){};
+    for (int n = 0; n < CONFIG_D2H_GYRO_BIAS_WINDOW; ++n) {
+        int32_t sample[BIAS_AXIS_COUNT] = {
+            [BIAS_GYRO_X] = true_bias[BIAS_GYRO_X] + noise(seed, 2),
+            [BIAS_GYRO_Y] = true_bias[BIAS_GYRO_Y] + noise(seed, 2),
+            [BIAS_GYRO_Z] = true_bias[BIAS_GYRO_Z] + noise(seed, 2),
+            [BIAS_ACCEL_X] = noise(seed, 3),
+            [BIAS_ACCEL_Y] = noise(seed, 3),
+            [BIAS_ACCEL_Z] = GRAVITY + noise(seed, 3),
+        };
+        bias_window_add(w, sample);
+    }
+}
+
+static void fill_turning(struct bias_window *w, int32_t rate, int32_t sweep)
+{
+    *w = (struct bias_window){};
+    for (int n = 0; n < CONFIG_D2H_GYRO_BIAS_WINDOW; ++n) {
+        int32_t swing = sweep * (n - CONFIG_D2H_GYRO_BIAS_WINDOW / 2);
+        int32_t sample[BIAS_AXIS_COUNT] = {
+            [BIAS_GYRO_X] = true_bias[BIAS_GYRO_X] + rate + swing,
+            [BIAS_GYRO_Y] = true_bias[BIAS_GYRO_Y],
+            [BIAS_GYRO_Z] = true_bias[BIAS_GYRO_Z],
+            [BIAS_ACCEL_Z] = GRAVITY,
+        };
+        bias_window_add(w, sample);
+    }
+}
+
+ZTEST(gyro_bias, test_still_window)
+{
+    struct bias_window w;
+    uint32_t variance[BIAS_AXIS_COUNT];
+    uint32_t seed = 1;
+
+    fill_still(&w, &seed);
+    zassert_true(bias_window_is_still(&w, variance));
+    for (size_t i = 0; i < BIAS_AXIS_COUNT; ++i) {
+        zassert_true(variance[i] <= 9, "axis %zu variance %u", i, variance[i]);
+    }
+}
+
+ZTEST(gyro_bias, test_moving_window)
+{
+    struct bias_window w;
+    uint32_t variance[BIAS_AXIS_COUNT];
+
+    fill_turning(&w, 0, 10);
+    zassert_false(bias_window_is_still(&w, variance));
+    zassert_true(variance[BIAS_GYRO_X] > CONFIG_D2H_GYRO_BIAS_GYRO_VAR_MAX);
+}
+
+ZTEST(gyro_bias, test_slow_turn)
+{
+    struct bias_window w;
+    uint32_t variance[BIAS_AXIS_COUNT];
+
+    /* steady enough to pass for still, but too fast to be bias */
+    fill_turning(&w, CONFIG_D2H_GYRO_BIAS_MAX + 1, 0);
+    zassert_false(bias_window_is_still(&w, variance));
+    zassert_equal(variance[BIAS_GYRO_X], 0);
+}
+
+ZTEST(gyro_bias, test_first_window_seeds_estimate)
+{
+    struct bias_window w;
+    int32_t bias_q8[BIAS_GYRO_AXIS_COUNT] = {};
+    int32_t residual_q8[BIAS_GYRO_AXIS_COUNT];
+
+    fill_turning(&w, 0, 0);
+    bias_window_correct(&w, true, bias_q8, residual_q8);
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        zassert_equal(bias_q8[i], true_bias[i] * 256);
+        zassert_equal(residual_q8[i], 0);
+    }
+}
+
+ZTEST(gyro_bias, test_residual_drift)
+{
+    struct bias_window w;
+    uint32_t variance[BIAS_AXIS_COUNT];
+    int32_t bias_q8[BIAS_GYRO_AXIS_COUNT] = {};
+    int32_t residual_q8[BIAS_GYRO_AXIS_COUNT];
+    uint32_t seed = 2;
+
+    /* the estimate starts from a stored one that's well off, and still
+     * windows pull it in while moving ones are ignored */
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        bias_q8[i] = (true_bias[i] + 20) * 256;
+    }
+    for (int n = 0; n < 40; ++n) {
+        if (n % 4 == 3) {
+            fill_turning(&w, 0, 10);
+        } else {
+            fill_still(&w, &seed);
+        }
+        if (bias_window_is_still(&w, variance)) {
+            bias_window_correct(&w, false, bias_q8, residual_q8);
+        }
+    }
+
+    /* within half a count per axis, so correcting with the rounded estimate
+     * leaves no drift */
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        int32_t drift_q8 = bias_q8[i] - true_bias[i] * 256;
+        zassert_true(abs(drift_q8) < 128, "axis %zu drift %d/256", i,
+            drift_q8);
+        zassert_equal((bias_q8[i] + 128) >> 8, true_bias[i]);
+    }
+
+    /* and a fresh still window has next to nothing left over */
+    fill_still(&w, &seed);
+    zassert_true(bias_window_is_still(&w, variance));
+    bias_window_correct(&w, false, bias_q8, residual_q8);
+    for (size_t i = 0; i < BIAS_GYRO_AXIS_COUNT; ++i) {
+        zassert_true(abs(residual_q8[i]) < 128, "axis %zu residual %d/256", i,
+            residual_q8[i]);
+    }
+}
+
+ZTEST_SUITE(gyro_bias, NULL, NULL, NULL, NULL, NULL);